@@ -0,0 +1,375 @@
+// trufflify_bench, google benchmark over the hot bits of the trufflifier
+// synthetic images are generated in memory so runs are repeatable, the real ones are
+// truffle.png (copied next to the binary) and whatever TRUFFLIFY_BENCH_INPUT points at
+//
+// trufflify_bench --benchmark_filter=Update   just the per frame cost
+// trufflify_bench --benchmark_repetitions=5   for numbers worth comparing
+
+#include "trufflifier.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <cstdlib>
+#include <limits>
+#include <map>
+#include <memory>
+#include <iostream>
+
+namespace {
+
+const char* targetPath = "truffle.png";
+
+// smooth gradient + a bit of noise, roughly what a photo looks like to the matcher
+sf::Image syntheticImage(unsigned int w, unsigned int h) {
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<int> noise(-12, 12);
+    std::vector<sf::Uint8> pixels((size_t)w * h * 4);
+
+    for (unsigned int y = 0; y < h; ++y) {
+        for (unsigned int x = 0; x < w; ++x) {
+            sf::Uint8* p = &pixels[((size_t)y * w + x) * 4];
+            p[0] = (sf::Uint8)std::clamp((int)(255 * x / w) + noise(rng), 0, 255);
+            p[1] = (sf::Uint8)std::clamp((int)(255 * y / h) + noise(rng), 0, 255);
+            p[2] = (sf::Uint8)std::clamp((int)(255 - 255 * (x + y) / (w + h)) + noise(rng), 0, 255);
+            p[3] = 255;
+        }
+    }
+
+    sf::Image image;
+    image.create(w, h, pixels.data());
+    return image;
+}
+
+// every colour different, worst case for the colour index
+std::vector<TargetTexel> syntheticTexels(unsigned int w, unsigned int h) {
+    std::mt19937 rng(5678);
+    std::uniform_int_distribution<int> channel(0, 255);
+    std::vector<TargetTexel> texels;
+    for (unsigned int y = 0; y < h; ++y) {
+        for (unsigned int x = 0; x < w; ++x) {
+            texels.push_back({sf::Color((sf::Uint8)channel(rng), (sf::Uint8)channel(rng), (sf::Uint8)channel(rng)), x, y});
+        }
+    }
+    return texels;
+}
+
+std::vector<TargetTexel> truffleTexels() {
+    std::vector<TargetTexel> texels;
+    sf::Image image;
+    if (!image.loadFromFile(targetPath)) return texels;
+    opaqueTexels(image, texels);
+    return texels;
+}
+
+// 0 = synthetic target, 1 = truffle.png
+const std::vector<TargetTexel>& benchTexels(int which) {
+    static const std::vector<TargetTexel> synthetic = syntheticTexels(256, 256);
+    static const std::vector<TargetTexel> truffle = truffleTexels();
+    return which == 0 ? synthetic : truffle;
+}
+
+std::vector<sf::Color> queryColors(size_t count) {
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> channel(0, 255);
+    std::vector<sf::Color> colors(count);
+    for (auto& c : colors) c = sf::Color((sf::Uint8)channel(rng), (sf::Uint8)channel(rng), (sf::Uint8)channel(rng));
+    return colors;
+}
+
+// the 1m case takes a while to set up so every size gets built once and kept
+// the input is 1000x1000, setMaxParticles picks the sample step from that
+Trufflifier* preparedApp(size_t particles, RenderMode mode) {
+    static std::map<std::pair<size_t, int>, std::unique_ptr<Trufflifier>> apps;
+    auto& app = apps[{particles, (int)mode}];
+    if (app) return app.get();
+
+    static const sf::Image input = syntheticImage(1000, 1000);
+    app.reset(new Trufflifier());
+    app->setTargetCache(false);
+    app->setSeed(1); // same layout every run so numbers compare
+    app->setRenderMode(mode);
+    app->setMaxParticles((float)particles);
+    if (!app->loadInput(input) || !app->loadTarget(targetPath)) {
+        app.reset();
+        return nullptr;
+    }
+    app->initParticles(canvasSize, canvasSize);
+    return app.get();
+}
+
+// initVertices falls back quietly when the context cant do buffers or shaders, dont time the wrong path
+const char* fallbackError(const Trufflifier& app, RenderMode mode) {
+    if (app.getRenderMode() != mode) return "shaders not available, fell back to cpu";
+    if (mode == RenderMode::Cpu && !app.isStreamingQuads()) return "buffer objects not available, fell back to sf::VertexArray";
+    return nullptr;
+}
+
+ParticleSystem randomParticles(size_t count) {
+    std::mt19937 rng(99);
+    std::uniform_real_distribution<float> pos(0.0f, (float)canvasSize);
+    std::uniform_real_distribution<float> size(1.0f, 4.0f);
+    ParticleSystem ps;
+    ps.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        ps.push(sf::Vector2f(pos(rng), pos(rng)), sf::Vector2f(pos(rng), pos(rng)), size(rng), sf::Color::White);
+    }
+    return ps;
+}
+
+} // namespace
+
+// matching
+
+static void BM_ColorDiff(benchmark::State& state) {
+    Trufflifier app;
+    std::vector<sf::Color> colors = queryColors(4096);
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(app.colorDiff(colors[i & 4095], colors[(i + 1) & 4095]));
+        ++i;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ColorDiff);
+
+// what the matcher did before the colour index, every target pixel checked
+static void BM_NearestBruteForce(benchmark::State& state) {
+    Trufflifier app;
+    const std::vector<TargetTexel>& texels = benchTexels((int)state.range(0));
+    std::vector<sf::Color> colors = queryColors(1024);
+    size_t i = 0;
+    for (auto _ : state) {
+        const sf::Color& q = colors[i++ & 1023];
+        long long best = std::numeric_limits<long long>::max();
+        int bestIndex = 0;
+        for (size_t k = 0; k < texels.size(); ++k) {
+            long long d = app.colorDiff(q, texels[k].color);
+            if (d < best) {
+                best = d;
+                bestIndex = (int)k;
+            }
+        }
+        benchmark::DoNotOptimize(bestIndex);
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetLabel(state.range(0) == 0 ? "synthetic" : "truffle");
+}
+BENCHMARK(BM_NearestBruteForce)->Arg(0)->Arg(1);
+
+static void BM_ToMatchColor(benchmark::State& state) {
+    std::vector<sf::Color> colors = queryColors(4096);
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(toMatchColor(colors[i++ & 4095], ColorSpace::OkLab));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ToMatchColor);
+
+static void BM_NearestColorIndex(benchmark::State& state, ColorSpace space) {
+    ColorIndex index;
+    index.build(benchTexels((int)state.range(0)), space);
+    std::vector<sf::Color> colors = queryColors(1024);
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(index.nearest(colors[i++ & 1023]));
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetLabel(state.range(0) == 0 ? "synthetic" : "truffle");
+}
+BENCHMARK_CAPTURE(BM_NearestColorIndex, rgb, ColorSpace::Rgb)->Arg(0)->Arg(1);
+BENCHMARK_CAPTURE(BM_NearestColorIndex, oklab, ColorSpace::OkLab)->Arg(0)->Arg(1);
+
+// --coarse lookup, centre scan + the scan inside the closest cluster (matchBands shares the first over 4 cells)
+static void BM_NearestPalette(benchmark::State& state) {
+    ColorIndex index;
+    index.build(benchTexels((int)state.range(0)), ColorSpace::Rgb);
+    ColorPalette palette;
+    palette.build(index);
+    std::vector<MatchColor> colors;
+    for (const sf::Color& c : queryColors(1024)) colors.push_back(toMatchColor(c, ColorSpace::Rgb));
+    size_t i = 0;
+    for (auto _ : state) {
+        const MatchColor& c = colors[i++ & 1023];
+        benchmark::DoNotOptimize(palette.nearestInCluster(palette.nearestCluster(c), c));
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetLabel(state.range(0) == 0 ? "synthetic" : "truffle");
+}
+BENCHMARK(BM_NearestPalette)->Arg(0)->Arg(1);
+
+// whole initParticles, timed with the match phase only (the vertex upload is its own benchmark)
+static void BM_InitParticles(benchmark::State& state, bool unique, ColorSpace space, bool coarse = false) {
+    static const sf::Image input = syntheticImage(1000, 1000);
+    Trufflifier app;
+    app.setTargetCache(false);
+    app.setSeed(1);
+    app.setUniqueMatch(unique);
+    app.setCoarseMatch(coarse);
+    app.setColorSpace(space);
+    app.setMaxParticles((float)state.range(0));
+    if (!app.loadInput(input) || !app.loadTarget(targetPath)) {
+        state.SkipWithError("could not load truffle.png");
+        return;
+    }
+    for (auto _ : state) {
+        app.initParticles(canvasSize, canvasSize);
+        state.SetIterationTime(app.getInitTimes().matchMs / 1000.0);
+    }
+    state.SetItemsProcessed(state.iterations() * (int64_t)app.getParticleCount());
+}
+BENCHMARK_CAPTURE(BM_InitParticles, nearest, false, ColorSpace::Rgb)->RangeMultiplier(10)->Range(10000, 1000000)->UseManualTime()->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_InitParticles, unique, true, ColorSpace::Rgb)->RangeMultiplier(10)->Range(10000, 1000000)->UseManualTime()->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_InitParticles, nearest_oklab, false, ColorSpace::OkLab)->RangeMultiplier(10)->Range(10000, 1000000)->UseManualTime()->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_InitParticles, unique_oklab, true, ColorSpace::OkLab)->RangeMultiplier(10)->Range(10000, 1000000)->UseManualTime()->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_InitParticles, coarse, false, ColorSpace::Rgb, true)->RangeMultiplier(10)->Range(10000, 1000000)->UseManualTime()->Unit(benchmark::kMillisecond);
+
+// real photo if there is one, otherwise the truffle gets trufflified
+static void BM_InitParticlesReal(benchmark::State& state) {
+    const char* env = std::getenv("TRUFFLIFY_BENCH_INPUT");
+    std::string inputPath = env ? env : targetPath;
+
+    Trufflifier app;
+    app.setTargetCache(false);
+    app.setSeed(1);
+    if (!app.load(inputPath, targetPath)) {
+        state.SkipWithError("could not load the input or truffle.png");
+        return;
+    }
+    for (auto _ : state) {
+        app.initParticles(canvasSize, canvasSize);
+        state.SetIterationTime(app.getInitTimes().matchMs / 1000.0);
+    }
+    state.SetItemsProcessed(state.iterations() * (int64_t)app.getParticleCount());
+    state.SetLabel(inputPath);
+}
+BENCHMARK(BM_InitParticlesReal)->UseManualTime()->Unit(benchmark::kMillisecond);
+
+// per frame
+
+static void BM_Update(benchmark::State& state, RenderMode mode) {
+    Trufflifier* app = preparedApp((size_t)state.range(0), mode);
+    if (!app) {
+        state.SkipWithError("could not load truffle.png");
+        return;
+    }
+    if (const char* error = fallbackError(*app, mode)) {
+        state.SkipWithError(error);
+        return;
+    }
+    float t = 0.0f;
+    for (auto _ : state) {
+        app->update(t);
+        t = t >= 1.0f ? 0.0f : t + 1.0f / 180.0f;
+    }
+    state.SetItemsProcessed(state.iterations() * (int64_t)app->getParticleCount());
+}
+BENCHMARK_CAPTURE(BM_Update, cpu, RenderMode::Cpu)->RangeMultiplier(10)->Range(10000, 1000000)->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(BM_Update, shader, RenderMode::Shader)->RangeMultiplier(10)->Range(10000, 1000000)->Unit(benchmark::kMicrosecond);
+
+// vertex generation
+
+static void BM_QuadKernel(benchmark::State& state, QuadKernel kernel) {
+    ParticleSystem ps = randomParticles((size_t)state.range(0));
+    std::vector<sf::Vector2f> vertices(ps.size() * 4);
+    float t = 0.0f;
+    for (auto _ : state) {
+        kernel(ps, t, vertices.data());
+        benchmark::ClobberMemory();
+        t = t >= 1.0f ? 0.0f : t + 1.0f / 180.0f;
+    }
+    state.SetItemsProcessed(state.iterations() * (int64_t)ps.size());
+    state.SetBytesProcessed(state.iterations() * (int64_t)(vertices.size() * sizeof(sf::Vector2f)));
+}
+BENCHMARK_CAPTURE(BM_QuadKernel, scalar, static_cast<QuadKernel>(buildQuadsScalar))->RangeMultiplier(10)->Range(10000, 1000000)->Unit(benchmark::kMicrosecond);
+#ifdef TRUFFLIFY_AVX2
+BENCHMARK_CAPTURE(BM_QuadKernel, avx2, buildQuadsAvx2)->RangeMultiplier(10)->Range(10000, 1000000)->Unit(benchmark::kMicrosecond);
+#endif
+#ifdef TRUFFLIFY_NEON
+BENCHMARK_CAPTURE(BM_QuadKernel, neon, buildQuadsNeon)->RangeMultiplier(10)->Range(10000, 1000000)->Unit(benchmark::kMicrosecond);
+#endif
+
+// colours + vbo create (+ the start/end corners for shader mode), once per init
+static void BM_InitVertices(benchmark::State& state, RenderMode mode) {
+    Trufflifier* app = preparedApp((size_t)state.range(0), mode);
+    if (!app) {
+        state.SkipWithError("could not load truffle.png");
+        return;
+    }
+    if (const char* error = fallbackError(*app, mode)) {
+        state.SkipWithError(error);
+        return;
+    }
+    for (auto _ : state) {
+        app->initVertices();
+    }
+    state.SetItemsProcessed(state.iterations() * (int64_t)app->getParticleCount());
+}
+BENCHMARK_CAPTURE(BM_InitVertices, cpu, RenderMode::Cpu)->RangeMultiplier(10)->Range(10000, 1000000)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_InitVertices, shader, RenderMode::Shader)->RangeMultiplier(10)->Range(10000, 1000000)->Unit(benchmark::kMillisecond);
+
+// loading
+
+static void BM_Downsample(benchmark::State& state) {
+    static const sf::Image input = syntheticImage(4000, 3000);
+    unsigned int step = sampleStep(4000, 3000, (float)state.range(0));
+    SampledImage out;
+    for (auto _ : state) {
+        downsampleImage(input, step, 0, out);
+        benchmark::DoNotOptimize(out.pixels.data());
+    }
+    state.SetBytesProcessed(state.iterations() * (int64_t)4000 * 3000 * 4);
+}
+BENCHMARK(BM_Downsample)->RangeMultiplier(10)->Range(10000, 1000000)->Unit(benchmark::kMillisecond);
+
+// the reorder pass sort on its own, random morton keys over n particles
+static void BM_RadixSort(benchmark::State& state) {
+    size_t n = (size_t)state.range(0);
+    std::mt19937 rng(7);
+    std::vector<std::uint32_t> input(n);
+    for (auto& k : input) k = mortonKey(rng() & 0xFFFF, rng() & 0xFFFF);
+
+    std::vector<std::uint32_t> keys, values(n), tmpKeys, tmpValues;
+    for (auto _ : state) {
+        state.PauseTiming();
+        keys = input;
+        for (size_t i = 0; i < n; ++i) values[i] = (std::uint32_t)i;
+        state.ResumeTiming();
+        radixSort(keys, values, tmpKeys, tmpValues, 0);
+        benchmark::DoNotOptimize(values.data());
+    }
+    state.SetItemsProcessed(state.iterations() * (int64_t)n);
+}
+BENCHMARK(BM_RadixSort)->RangeMultiplier(10)->Range(10000, 1000000)->Unit(benchmark::kMillisecond);
+
+// target scan on a 4k target, arg = percent of pixels left transparent (in blobs, like a cutout)
+static void BM_OpaqueTexels(benchmark::State& state) {
+    sf::Image image = syntheticImage(4096, 4096);
+    std::mt19937 rng(99);
+    std::uniform_int_distribution<int> percent(0, 99);
+    for (unsigned int y = 0; y < 4096; y += 32) {
+        for (unsigned int x = 0; x < 4096; x += 32) {
+            if (percent(rng) >= state.range(0)) continue;
+            for (unsigned int by = y; by < y + 32; ++by) {
+                for (unsigned int bx = x; bx < x + 32; ++bx) image.setPixel(bx, by, sf::Color::Transparent);
+            }
+        }
+    }
+    std::vector<TargetTexel> texels;
+    for (auto _ : state) {
+        opaqueTexels(image, texels);
+        benchmark::DoNotOptimize(texels.data());
+    }
+    state.SetBytesProcessed(state.iterations() * (int64_t)4096 * 4096 * 4);
+}
+BENCHMARK(BM_OpaqueTexels)->Arg(0)->Arg(50)->Arg(90)->Unit(benchmark::kMillisecond);
+
+// every init uploads gl buffers, so a context has to be current for the whole run
+int main(int argc, char** argv) {
+    sf::Context context;
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
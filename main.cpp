@@ -1,271 +1,1105 @@
-#include <SFML/Graphics.hpp>
+#include "trufflifier.hpp"
+
 #include <iostream>
-#include <vector>
-#include <string>
-#include <random>
 #include <cmath>
-#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <csignal>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <limits>
+#include <type_traits>
 
-struct Config {
-    std::string inputPath;
-    std::string targetPath = "truffle.png"; // the secret sauce
+// video export
+// the render loop reads frames back through two pbos (frame n gets mapped while n+1 is being read)
+// and hands them to an encoder thread through a small bounded queue so it never waits on disk/ffmpeg
+
+// one rgba frame, top row first
+struct Frame {
+    std::vector<sf::Uint8> pixels;
+    unsigned int index = 0;
 };
 
-struct Particle {
-    sf::Vector2f startPos;
-    sf::Vector2f endPos;
-    sf::Color startColor;
-    sf::Color endColor;
-    sf::Vector2f currentPos;
-    sf::Color currentColor;
-    float size;
+// bounded hand-off between threads, push blocks while the consumer is behind
+template<typename T>
+class BoundedQueue {
+private:
+    std::mutex mutex;
+    std::condition_variable notFull, notEmpty;
+    std::deque<T> items;
+    size_t capacity;
+    bool closed = false;
+
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+    void push(T&& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [&] { return items.size() < capacity; });
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+    }
+
+    // false once closed and drained
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [&] { return !items.empty() || closed; });
+        if (items.empty()) return false;
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+    }
 };
 
-// cubic moves only
-float easeOutCubic(float x) {
-    return 1.0f - pow(1.0f - x, 3.0f);
-}
+// between the render loop and the encoder, spent buffers come back for reuse
+class FrameQueue : public BoundedQueue<Frame> {
+private:
+    std::mutex spareMutex;
+    std::vector<Frame> spare;
 
-class Trufflifier {
+public:
+    explicit FrameQueue(size_t capacity) : BoundedQueue<Frame>(capacity) {}
+
+    void recycle(Frame&& frame) {
+        std::lock_guard<std::mutex> lock(spareMutex);
+        spare.push_back(std::move(frame));
+    }
+
+    // an old buffer if there is one so steady state doesnt allocate
+    Frame take() {
+        std::lock_guard<std::mutex> lock(spareMutex);
+        if (spare.empty()) return Frame();
+        Frame f = std::move(spare.back());
+        spare.pop_back();
+        return f;
+    }
+};
+
+class FrameSink {
+public:
+    virtual ~FrameSink() {}
+    virtual bool write(const Frame& frame, unsigned int w, unsigned int h) = 0;
+    virtual bool finish() { return true; }
+};
+
+// frames/%04d.png style, or a folder which gets frame_0000.png etc
+class PngSequenceSink : public FrameSink {
 private:
-    std::vector<Particle> particles;
-    sf::VertexArray vertexArray;
-    float baseParticleSize = 1.0f;
+    std::string pattern;
+    sf::Image image;
 
-    sf::Image inputImage;
-    sf::Image targetImage;
+public:
+    explicit PngSequenceSink(const std::string& path) {
+        if (path.find('%') != std::string::npos) {
+            pattern = path;
+        } else {
+            std::error_code ec;
+            std::filesystem::create_directories(path, ec);
+            pattern = (std::filesystem::path(path) / "frame_%04d.png").string();
+        }
+    }
+
+    bool write(const Frame& frame, unsigned int w, unsigned int h) override {
+        char name[1024];
+        std::snprintf(name, sizeof(name), pattern.c_str(), frame.index);
+        image.create(w, h, frame.pixels.data());
+        return image.saveToFile(name);
+    }
+};
+
+// pipes raw rgba into an ffmpeg process, needs ffmpeg on the PATH
+class FfmpegSink : public FrameSink {
+private:
+    FILE* pipe = nullptr;
 
 public:
-    Trufflifier() : vertexArray(sf::Quads) {}
+    FfmpegSink(const std::string& path, unsigned int w, unsigned int h, unsigned int fps) {
+        bool gif = std::filesystem::path(path).extension() == ".gif";
+        std::string cmd = "ffmpeg -y -loglevel error -f rawvideo -pix_fmt rgba -s " + std::to_string(w) + "x" + std::to_string(h) +
+                          " -r " + std::to_string(fps) + " -i - " + (gif ? "" : "-pix_fmt yuv420p ") + "\"" + path + "\"";
+#ifdef _WIN32
+        pipe = _popen(cmd.c_str(), "wb");
+#else
+        std::signal(SIGPIPE, SIG_IGN); // ffmpeg dying should be a write error, not kill us
+        pipe = popen(cmd.c_str(), "w");
+#endif
+    }
 
-    bool load(const std::string& inputPath, const std::string& targetPath) {
-        if (!inputImage.loadFromFile(inputPath)) {
-            std::cout << "Failed to load input: " << inputPath << std::endl;
-            return false;
+    ~FfmpegSink() override {
+        finish();
+    }
+
+    bool ok() const {
+        return pipe != nullptr;
+    }
+
+    bool write(const Frame& frame, unsigned int, unsigned int) override {
+        return pipe && std::fwrite(frame.pixels.data(), 1, frame.pixels.size(), pipe) == frame.pixels.size();
+    }
+
+    bool finish() override {
+        if (!pipe) return true;
+#ifdef _WIN32
+        int status = _pclose(pipe);
+#else
+        int status = pclose(pipe);
+#endif
+        pipe = nullptr;
+        return status == 0;
+    }
+};
+
+// double buffered async glReadPixels, read into one pbo while the other one gets mapped
+class PboReader {
+private:
+    GlBufferFunctions gl;
+    GLuint pbos[2] = {0, 0};
+    bool pending[2] = {false, false};
+    unsigned int frameIndex[2] = {0, 0};
+    int current = 0;
+    unsigned int width = 0, height = 0;
+
+    bool collect(int slot, Frame& out) {
+        if (!pending[slot]) return false;
+        gl.bindBuffer(GL_PIXEL_PACK_BUFFER, pbos[slot]);
+        const sf::Uint8* src = (const sf::Uint8*)gl.mapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+        if (src) {
+            // gl rows are bottom up
+            size_t row = (size_t)width * 4;
+            out.pixels.resize(row * height);
+            for (unsigned int y = 0; y < height; ++y) {
+                std::memcpy(&out.pixels[(height - 1 - y) * row], src + y * row, row);
+            }
+            out.index = frameIndex[slot];
+            gl.unmapBuffer(GL_PIXEL_PACK_BUFFER);
+        }
+        gl.bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        pending[slot] = false;
+        return src != nullptr;
+    }
+
+public:
+    ~PboReader() {
+        if (pbos[0]) gl.deleteBuffers(2, pbos);
+    }
+
+    // needs the target active, false if the driver has no pbos
+    bool init(unsigned int w, unsigned int h) {
+        if (!gl.load()) return false;
+        width = w;
+        height = h;
+        gl.genBuffers(2, pbos);
+        for (GLuint pbo : pbos) {
+            gl.bindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+            gl.bufferData(GL_PIXEL_PACK_BUFFER, (std::ptrdiff_t)w * h * 4, nullptr, GL_STREAM_READ);
         }
+        gl.bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        return pbos[0] && pbos[1];
+    }
+
+    // starts reading the bound framebuffer, gives back the previous frame once it is done
+    bool read(unsigned int index, Frame& out) {
+        gl.bindBuffer(GL_PIXEL_PACK_BUFFER, pbos[current]);
+        glReadPixels(0, 0, (GLsizei)width, (GLsizei)height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        gl.bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        pending[current] = true;
+        frameIndex[current] = index;
+
+        current = 1 - current;
+        return collect(current, out);
+    }
+
+    // whatever is still in flight after the last frame
+    bool flush(Frame& out) {
+        current = 1 - current;
+        return collect(current, out);
+    }
+};
 
-        // try to load truffle, fallback if not found
-        if (!targetImage.loadFromFile(targetPath)) {
-            std::cout << "Failed to load target (truffle.png). Make sure it is in the same directory." << std::endl;
+
+// watches how long update() + draw() take and nudges the particle budget to hold a frame time
+// cost is about linear in particle count so it just scales by target / measured
+class AdaptiveQuality {
+private:
+    float targetMs;
+    float maxBudget;
+    float budget;
+    float totalMs = 0.0f;
+    int frames = 0;
+    sf::Clock sinceChange;
+
+public:
+    AdaptiveQuality(float targetMs, float maxBudget) : targetMs(targetMs), maxBudget(maxBudget), budget(maxBudget) {}
+
+    // true when the budget moved and it is worth re-initialising
+    bool addFrame(float ms) {
+        totalMs += ms;
+        ++frames;
+        if (frames < 30 || sinceChange.getElapsedTime().asSeconds() < 0.5f) return false;
+
+        float avg = totalMs / frames;
+        totalMs = 0.0f;
+        frames = 0;
+
+        float next = budget;
+        if (avg > targetMs) {
+            next = budget * std::max(0.25f, targetMs / avg * 0.9f); // a bit of headroom
+        } else if (avg < targetMs * 0.6f && budget < maxBudget) {
+            next = std::min(maxBudget, budget * std::min(2.0f, targetMs / avg * 0.8f));
+        }
+        next = std::max(1000.0f, next);
+
+        if (std::fabs(next - budget) < budget * 0.05f) return false;
+        budget = next;
+        sinceChange.restart();
+        return true;
+    }
+
+    float getBudget() const {
+        return budget;
+    }
+};
+
+// per frame timings for the last few seconds + the init phases, optionally logged to csv
+class Profiler {
+public:
+    struct Frame {
+        double updateMs = 0.0;
+        double drawMs = 0.0;
+        double displayMs = 0.0;
+        double frameMs = 0.0; // start of one frame to the start of the next
+        size_t particles = 0;
+        size_t vertices = 0; // uploaded this frame
+    };
+
+private:
+    std::vector<Frame> ring;
+    size_t next = 0;
+    size_t filled = 0;
+    unsigned long long frameCount = 0;
+    std::ofstream csv;
+
+public:
+    explicit Profiler(size_t capacity = 600) : ring(capacity) {}
+
+    bool openCsv(const std::string& path) {
+        csv.open(path, std::ios::trunc);
+        if (!csv) {
+            std::cout << "Failed to open profile output: " << path << std::endl;
             return false;
         }
+        csv << "frame,update_ms,draw_ms,display_ms,frame_ms,particles,vertices_uploaded,load_input_ms,load_target_ms,target_scan_ms,match_ms\n";
         return true;
     }
 
-    long long colorDiff(const sf::Color& c1, const sf::Color& c2) {
-        long long dr = (long long)c1.r - c2.r;
-        long long dg = (long long)c1.g - c2.g;
-        long long db = (long long)c1.b - c2.b;
-        return dr*dr + dg*dg + db*db;
+    void addFrame(const Frame& f, const InitTimes& init) {
+        ring[next] = f;
+        next = (next + 1) % ring.size();
+        filled = std::min(filled + 1, ring.size());
+
+        if (csv) {
+            csv << frameCount << ',' << f.updateMs << ',' << f.drawMs << ',' << f.displayMs << ',' << f.frameMs << ','
+                << f.particles << ',' << f.vertices << ',' << init.loadInputMs << ',' << init.loadTargetMs << ','
+                << init.targetScanMs << ',' << init.matchMs << '\n';
+        }
+        ++frameCount;
     }
 
-    void initParticles(unsigned int windowW, unsigned int windowH) {
-        particles.clear();
+    // p in 0..1 over the frame times in the ring
+    double percentile(double p) const {
+        if (filled == 0) return 0.0;
+        std::vector<double> times(filled);
+        for (size_t i = 0; i < filled; ++i) times[i] = ring[i].frameMs;
+        size_t k = std::min(filled - 1, (size_t)(p * filled));
+        std::nth_element(times.begin(), times.begin() + k, times.end());
+        return times[k];
+    }
 
-        // 1. where do we want them to go?
-        float targetAspect = (float)targetImage.getSize().x / targetImage.getSize().y;
-        float windowAspect = (float)windowW / windowH;
+    const Frame& last() const {
+        return ring[(next + ring.size() - 1) % ring.size()];
+    }
+};
 
-        float targetScale;
-        if (targetAspect > windowAspect) {
-            targetScale = (windowW * 0.8f) / targetImage.getSize().x;
-        } else {
-            targetScale = (windowH * 0.8f) / targetImage.getSize().y;
+// --virtual: the particles get matched once on a fixed size canvas and a letterboxed view scales
+// it to whatever the window is, so a 4k screen or a resize never rematches or needs more particles
+// --supersample n draws that canvas n times bigger offscreen and filters it down onto the window,
+// only the fill rate changes with it
+class VirtualCanvas {
+private:
+    sf::Vector2f size;
+    unsigned int supersample;
+    sf::View view; // virtual coords, viewport letterboxed into the window
+    sf::FloatRect area; // that viewport in window pixels
+    sf::RenderTexture offscreen;
+    bool useOffscreen = false;
+
+public:
+    VirtualCanvas(unsigned int width, unsigned int height, unsigned int supersample)
+        : size((float)width, (float)height), supersample(std::max(1u, supersample)),
+          view(sf::FloatRect(0.0f, 0.0f, (float)width, (float)height)) {}
+
+    sf::Vector2u getSize() const {
+        return sf::Vector2u((unsigned int)size.x, (unsigned int)size.y);
+    }
+
+    void resize(unsigned int windowW, unsigned int windowH) {
+        // minimised windows can report 0x0, keep the last layout until there is something to fit
+        if (windowW == 0 || windowH == 0) return;
+
+        // biggest rect with the canvas aspect that fits, centred
+        float scale = std::min(windowW / size.x, windowH / size.y);
+        area = sf::FloatRect((windowW - size.x * scale) / 2.0f, (windowH - size.y * scale) / 2.0f, size.x * scale, size.y * scale);
+        view.setViewport(sf::FloatRect(area.left / windowW, area.top / windowH, area.width / windowW, area.height / windowH));
+
+        if (supersample <= 1) return;
+        unsigned int maxSize = sf::Texture::getMaximumSize();
+        unsigned int w = std::min(maxSize, (unsigned int)std::ceil(area.width * supersample));
+        unsigned int h = std::min(maxSize, (unsigned int)std::ceil(area.height * supersample));
+        useOffscreen = w > 0 && h > 0 && offscreen.create(w, h);
+        if (!useOffscreen) {
+            std::cout << "Failed to create the supersampled canvas, drawing straight to the window." << std::endl;
+            return;
+        }
+        offscreen.setSmooth(true);
+        offscreen.setView(sf::View(sf::FloatRect(0.0f, 0.0f, size.x, size.y)));
+    }
+
+    // where the particles go this frame, the offscreen one comes back cleared
+    sf::RenderTarget& begin(sf::RenderWindow& window) {
+        if (!useOffscreen) {
+            window.setView(view);
+            return window;
+        }
+        offscreen.clear(backgroundColor);
+        return offscreen;
+    }
+
+    // filters the offscreen canvas down into its spot in the window, nothing to do without it
+    // the mipmaps are what make anything past 2x average every texel instead of skipping some
+    void finish(sf::RenderWindow& window) {
+        if (!useOffscreen) return;
+        offscreen.display();
+        offscreen.generateMipmap();
+
+        window.setView(sf::View(sf::FloatRect(0.0f, 0.0f, (float)window.getSize().x, (float)window.getSize().y)));
+        sf::Sprite sprite(offscreen.getTexture());
+        sprite.setPosition(area.left, area.top);
+        sprite.setScale(area.width / offscreen.getSize().x, area.height / offscreen.getSize().y);
+        window.draw(sprite);
+    }
+};
+
+// "1600x900" -> 1600, 900, a single number is a square
+bool parseSize(const std::string& text, unsigned int& width, unsigned int& height) {
+    unsigned int w = 0, h = 0;
+    int n = std::sscanf(text.c_str(), "%ux%u", &w, &h);
+    if (n == 1) h = w;
+    if (n < 1 || w == 0 || h == 0) {
+        std::cout << "Bad size " << text << ", wants something like 1600x900." << std::endl;
+        return false;
+    }
+    width = w;
+    height = h;
+    return true;
+}
+
+// checked number flags, junk or anything under min gets reported and main bails out like parseSize
+template <typename T>
+bool parseNumber(const std::string& flag, const std::string& text, T min, T& value) {
+    const char* begin = text.c_str();
+    char* end = nullptr;
+    errno = 0;
+    bool ok = false;
+    T v = min;
+    if constexpr (std::is_floating_point<T>::value) {
+        double n = std::strtod(begin, &end);
+        ok = std::isfinite(n) && n >= (double)min && n <= (double)std::numeric_limits<T>::max();
+        v = (T)n;
+    } else {
+        long long n = std::strtoll(begin, &end, 10);
+        ok = n >= (long long)min && (unsigned long long)n <= (unsigned long long)std::numeric_limits<T>::max();
+        v = (T)n;
+    }
+    if (!ok || errno == ERANGE || end == begin || *end != '\0') {
+        std::cout << "Bad " << flag << " " << text << ", wants a number of at least " << min << "." << std::endl;
+        return false;
+    }
+    value = v;
+    return true;
+}
+
+// tiny 3x5 pixel font so the overlay doesnt need a ttf lying around
+// 15 bits per glyph, top row first, msb is the top left pixel
+unsigned int glyphBits(char c) {
+    static const std::pair<char, unsigned int> glyphs[] = {
+    {'0', 0x7B6F}, {'1', 0x2C97}, {'2', 0x73E7}, {'3', 0x73CF}, {'4', 0x5BC9}, {'5', 0x79CF},
+    {'6', 0x79EF}, {'7', 0x7249}, {'8', 0x7BEF}, {'9', 0x7BCF}, {'A', 0x2BED}, {'B', 0x6BAE},
+    {'C', 0x3923}, {'D', 0x6B6E}, {'E', 0x79A7}, {'F', 0x79A4}, {'G', 0x396B}, {'H', 0x5BED},
+    {'I', 0x7497}, {'J', 0x126A}, {'K', 0x5BAD}, {'L', 0x4927}, {'M', 0x5FED}, {'N', 0x6B6D},
+    {'O', 0x2B6A}, {'P', 0x6BA4}, {'Q', 0x2B73}, {'R', 0x6BAD}, {'S', 0x388E}, {'T', 0x7492},
+    {'U', 0x5B6F}, {'V', 0x5B6A}, {'W', 0x5BFD}, {'X', 0x5AAD}, {'Y', 0x5A92}, {'Z', 0x72A7},
+    {'.', 0x0002}, {':', 0x0410}, {'-', 0x01C0}, {'/', 0x12A4}, {'%', 0x52A5}
+    };
+    for (const auto& g : glyphs) {
+        if (g.first == c) return g.second;
+    }
+    return 0; // space + anything unknown
+}
+
+// appends quads for text at (x, y), every font pixel is scale screen pixels
+void appendText(sf::VertexArray& out, const std::string& text, float x, float y, float scale, sf::Color color) {
+    for (char ch : text) {
+        unsigned int bits = glyphBits((char)std::toupper((unsigned char)ch));
+        for (int i = 0; i < 15; ++i) {
+            if (!(bits & (1u << (14 - i)))) continue;
+            float px = x + (i % 3) * scale;
+            float py = y + (i / 3) * scale;
+            out.append(sf::Vertex(sf::Vector2f(px, py), color));
+            out.append(sf::Vertex(sf::Vector2f(px + scale, py), color));
+            out.append(sf::Vertex(sf::Vector2f(px + scale, py + scale), color));
+            out.append(sf::Vertex(sf::Vector2f(px, py + scale), color));
+        }
+        x += 4 * scale;
+    }
+}
+
+// p50/p99 frame time, phase split, particle + vertex counts in the top left
+void drawProfilerOverlay(sf::RenderTarget& target, const Profiler& profiler, const InitTimes& init) {
+    const Profiler::Frame& f = profiler.last();
+    char lines[4][128];
+    std::snprintf(lines[0], sizeof(lines[0]), "FRAME P50 %.2fMS P99 %.2fMS", profiler.percentile(0.5), profiler.percentile(0.99));
+    std::snprintf(lines[1], sizeof(lines[1]), "UPDATE %.2f DRAW %.2f DISPLAY %.2f", f.updateMs, f.drawMs, f.displayMs);
+    std::snprintf(lines[2], sizeof(lines[2]), "PARTICLES %zu VERTS %zu", f.particles, f.vertices);
+    std::snprintf(lines[3], sizeof(lines[3]), "LOAD %.1f TARGET %.1f SCAN %.1f MATCH %.1f", init.loadInputMs, init.loadTargetMs, init.targetScanMs, init.matchMs);
+
+    const float scale = 2.0f;
+    sf::VertexArray text(sf::Quads);
+    for (int i = 0; i < 4; ++i) appendText(text, lines[i], 8.0f, 8.0f + i * 7 * scale, scale, sf::Color(230, 230, 230));
+
+    // fixed to the window no matter what view the particles use
+    sf::View old = target.getView();
+    target.setView(sf::View(sf::FloatRect(0.0f, 0.0f, (float)target.getSize().x, (float)target.getSize().y)));
+    target.draw(text);
+    target.setView(old);
+}
+
+// reads one input path per line, blank lines skipped
+bool readInputList(const std::string& listPath, std::vector<std::string>& out) {
+    std::ifstream in(listPath);
+    if (!in) {
+        std::cout << "Failed to open input list: " << listPath << std::endl;
+        return false;
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (!line.empty()) out.push_back(line);
+    }
+    return true;
+}
+
+// "0,0.5,1" -> {0, 0.5, 1}
+std::vector<float> parseFrames(const std::string& list) {
+    std::vector<float> frames;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) frames.push_back(std::min(1.0f, std::max(0.0f, std::stof(item))));
+    }
+    return frames;
+}
+
+// --ease cubic|linear|inout|back or four numbers for a cubic-bezier, like css
+bool parseEasing(const std::string& value, AnimationStyle& style) {
+    if (value == "cubic") style.easing = Easing::OutCubic;
+    else if (value == "linear") style.easing = Easing::Linear;
+    else if (value == "inout") style.easing = Easing::InOutCubic;
+    else if (value == "back") style.easing = Easing::OutBack;
+    else {
+        // y can go past 0..1 for overshoot, x gets clamped later
+        float b[4];
+        std::stringstream ss(value);
+        std::string item;
+        int count = 0;
+        while (std::getline(ss, item, ',')) {
+            if (count == 4) return false;
+            try { b[count++] = std::stof(item); } catch (...) { return false; }
         }
-        targetScale = std::max(1.0f, targetScale);
-
-        float targetOffsetX = (windowW - targetImage.getSize().x * targetScale) / 2.0f;
-        float targetOffsetY = (windowH - targetImage.getSize().y * targetScale) / 2.0f;
-
-        // 2. where do they start?
-        // if the input is huge, we need to chill and downsample
-        // aiming for ~15k
-        unsigned int inW = inputImage.getSize().x;
-        unsigned int inH = inputImage.getSize().y;
-        float maxParticles = 15000.0f;
-        float ratio = std::sqrt(maxParticles / (inW * inH));
-        // skip pixels if too many
-        int step = 1;
-        if (ratio < 1.0f) {
-            step = (int)(1.0f / ratio);
+        if (count != 4) return false;
+        style.easing = Easing::Bezier;
+        std::copy(b, b + 4, style.bezier);
+    }
+    return true;
+}
+
+// cat.jpg at t=0.5 -> outDir/cat_t050.png, or outDir/cat_xmas_t050.png if there is more than one target
+std::string framePath(const std::string& outDir, const std::string& inputName, const std::string& targetName, float t) {
+    char suffix[16];
+    std::snprintf(suffix, sizeof(suffix), "_t%03d.png", (int)std::lround(t * 100.0f));
+    std::string name = inputName;
+    if (!targetName.empty()) name += "_" + targetName;
+    return (std::filesystem::path(outDir) / (name + suffix)).string();
+}
+
+// what framePath calls an input, the file stem unless another input already wrote that stem into
+// the same folder (a/photo.jpg + b/photo.jpg), then stem_<id> so neither overwrites the other
+// the same input again keeps its name
+class OutputNames {
+private:
+    std::map<std::string, std::string> owners; // outDir/stem -> the input that has it
+
+public:
+    std::string get(const std::string& outDir, const std::string& inputPath, unsigned int id) {
+        std::string stem = std::filesystem::path(inputPath).stem().string();
+        std::string input = std::filesystem::path(inputPath).lexically_normal().string();
+        auto it = owners.emplace((std::filesystem::path(outDir) / stem).string(), input).first;
+        if (it->second == input) return stem;
+        return stem + "_" + std::to_string(id);
+    }
+};
+
+// renders the whole animation at a fixed timestep and streams it to a video or png sequence
+// rendering + readback stay on this thread, encoding runs on its own behind a bounded queue
+int runExport(const Config& config) {
+    sf::RenderTexture canvas;
+    if (!canvas.create(canvasSize, canvasSize)) {
+        std::cout << "Failed to create offscreen render target." << std::endl;
+        return -1;
+    }
+
+    if (config.inputPaths.size() > 1) {
+        std::cout << "Export only uses the first input: " << config.inputPaths.front() << std::endl;
+    }
+    if (config.targetPaths.size() > 1) {
+        std::cout << "Export only uses the first target: " << config.targetPaths.front() << std::endl;
+    }
+
+    Trufflifier app;
+    applyConfig(app, config);
+    if (!app.load(config.inputPaths.front(), config.targetPaths.front())) return -1;
+    app.initParticles(canvasSize, canvasSize);
+
+    std::string ext = std::filesystem::path(config.exportPath).extension().string();
+    std::unique_ptr<FrameSink> sink;
+    if (ext == ".mp4" || ext == ".gif" || ext == ".webm" || ext == ".mkv" || ext == ".mov") {
+        std::unique_ptr<FfmpegSink> ffmpeg(new FfmpegSink(config.exportPath, canvasSize, canvasSize, config.fps));
+        if (!ffmpeg->ok()) {
+            std::cout << "Failed to start ffmpeg, is it installed?" << std::endl;
+            return -1;
         }
+        sink = std::move(ffmpeg);
+    } else {
+        sink.reset(new PngSequenceSink(config.exportPath));
+    }
 
-        // calculate display size so the input fits
-        float displayScaleX = (float)windowW / inW;
-        float displayScaleY = (float)windowH / inH;
-        float displayScale = std::min(displayScaleX, displayScaleY) * 0.8f; // 80% of window cause margins are nice
-
-        float inputOffsetX = (windowW - inW * displayScale) / 2.0f;
-        float inputOffsetY = (windowH - inH * displayScale) / 2.0f;
-
-        // make particles fatter if we skipped pixels
-        baseParticleSize = std::max(1.0f, displayScale * step);
-
-        // pre-calculate target spots so we can find them fast
-        // list of {color, pos} basically
-        struct TargetPixel {
-            sf::Color color;
-            sf::Vector2f pos;
-        };
-        std::vector<TargetPixel> targetPixels;
-        targetPixels.reserve(targetImage.getSize().x * targetImage.getSize().y);
-
-        for(unsigned int y=0; y<targetImage.getSize().y; ++y) {
-             for(unsigned int x=0; x<targetImage.getSize().x; ++x) {
-                 sf::Color c = targetImage.getPixel(x, y);
-                 if(c.a > 0) {
-                     targetPixels.push_back({c, sf::Vector2f(targetOffsetX + x * targetScale, targetOffsetY + y * targetScale)});
-                 }
-             }
+    FrameQueue queue(8);
+    bool encodeOk = true;
+    std::thread encoder([&]() {
+        Frame frame;
+        while (queue.pop(frame)) {
+            if (!sink->write(frame, canvasSize, canvasSize)) encodeOk = false;
+            queue.recycle(std::move(frame));
         }
+        if (!sink->finish()) encodeOk = false;
+    });
 
-        std::mt19937 rng(std::random_device{}()); // this is disgusting
+    canvas.setActive(true);
+    PboReader reader;
+    bool usePbo = reader.init(canvasSize, canvasSize);
 
-        std::uniform_real_distribution<float> jitterDist(-targetScale * 0.4f, targetScale * 0.4f); // make it messy
-        std::uniform_real_distribution<float> sizeDist(0.8f, 1.2f); // also size dist
+    unsigned int frameCount = std::max(2u, (unsigned int)std::lround(animationDuration * config.fps) + 1);
+    for (unsigned int i = 0; i < frameCount; ++i) {
+        app.update((float)i / (frameCount - 1));
+        canvas.clear(backgroundColor);
+        app.draw(canvas);
+        canvas.display();
 
-        // 3. iterate over input image
-        for (unsigned int y = 0; y < inH; y += step) {
-            for (unsigned int x = 0; x < inW; x += step) {
-                sf::Color inputCol = inputImage.getPixel(x, y);
+        Frame frame = queue.take();
+        if (usePbo) {
+            canvas.setActive(true);
+            if (reader.read(i, frame)) queue.push(std::move(frame));
+            else queue.recycle(std::move(frame));
+        } else {
+            // no pbos, plain blocking readback
+            sf::Image image = canvas.getTexture().copyToImage();
+            const sf::Uint8* pixels = image.getPixelsPtr();
+            frame.pixels.assign(pixels, pixels + (size_t)image.getSize().x * image.getSize().y * 4);
+            frame.index = i;
+            queue.push(std::move(frame));
+        }
+    }
+    if (usePbo) {
+        Frame frame = queue.take();
+        if (reader.flush(frame)) queue.push(std::move(frame));
+    }
 
-                // invisible pixels are skipped
-                if(inputCol.a == 0) continue;
+    queue.close();
+    encoder.join();
 
-                Particle p;
-                p.startPos = sf::Vector2f(inputOffsetX + x * displayScale, inputOffsetY + y * displayScale);
-                p.startColor = inputCol;
-                p.currentColor = inputCol;
-                p.size = baseParticleSize * sizeDist(rng); // random fat
+    if (!encodeOk) {
+        std::cout << "Failed to write export: " << config.exportPath << std::endl;
+        return 1;
+    }
+    std::cout << "Exported " << frameCount << " frames to " << config.exportPath << std::endl;
+    return 0;
+}
 
-                // find best match in target
-                if (targetPixels.empty()) {
-                    p.endPos = p.startPos;
-                } else {
-                    // checking every single pixel is slow
-                    // checking random ones is fast and usually good enough
-                    // chaos theory
-                    int bestIndex = 0;
-                    long long minDiff = -1;
-
-                    int samples = 100;
-                    std::uniform_int_distribution<int> distT(0, targetPixels.size() - 1);
-
-                    for(int i=0; i<samples; ++i) {
-                        int idx = distT(rng);
-                        long long diff = colorDiff(inputCol, targetPixels[idx].color);
-                        if (minDiff == -1 || diff < minDiff) {
-                            minDiff = diff;
-                            bestIndex = idx;
-                        }
-                    }
+// no window, renders every input into an offscreen texture and writes the frames out
+// the target + its index are loaded once and reused for every input
+int runHeadless(const Config& config) {
+    sf::RenderTexture canvas;
+    if (!canvas.create(canvasSize, canvasSize)) {
+        std::cout << "Failed to create offscreen render target." << std::endl;
+        return -1;
+    }
 
-                    // jitter the end pos so it doesnt look like a boring grid
-                    p.endPos = targetPixels[bestIndex].pos;
-                    p.endPos.x += jitterDist(rng);
-                    p.endPos.y += jitterDist(rng);
+    std::error_code ec;
+    std::filesystem::create_directories(config.outDir, ec);
 
-                    p.endColor = targetPixels[bestIndex].color;
-                }
+    Trufflifier app;
+    applyConfig(app, config);
+    TargetLibrary targets;
+    if (!targets.load(config.targetPaths, config.colorSpace, config.targetCache, config.threads)) return -1;
+
+    // repeat inputs in the list skip straight to drawing, only hits with a fixed --seed
+    std::unique_ptr<ResultCache> resultCache;
+    if (config.resultCacheMb > 0) {
+        resultCache.reset(new ResultCache(config.resultCacheMb << 20));
+        app.setResultCache(resultCache.get());
+    }
+
+    std::vector<float> frames = config.frames;
+    if (frames.empty()) frames.push_back(1.0f);
+
+    size_t done = 0;
+    OutputNames names;
+    for (size_t n = 0; n < config.inputPaths.size(); ++n) {
+        const std::string& inputPath = config.inputPaths[n];
+        if (!app.loadInput(inputPath)) continue;
+        std::string inputName = names.get(config.outDir, inputPath, (unsigned int)n + 1);
 
-                particles.push_back(p);
+        // every input against every target, only the matching reruns per target
+        bool ok = true;
+        for (size_t i = 0; i < targets.size(); ++i) {
+            app.setTarget(targets.get(i));
+            app.initParticles(canvasSize, canvasSize);
+
+            std::string targetName = targets.size() > 1 ? std::filesystem::path(targets.get(i)->path).stem().string() : "";
+            for (float t : frames) {
+                app.update(t);
+                canvas.clear(backgroundColor);
+                app.draw(canvas);
+                canvas.display();
+
+                std::string outPath = framePath(config.outDir, inputName, targetName, t);
+                if (!canvas.getTexture().copyToImage().saveToFile(outPath)) {
+                    std::cout << "Failed to write: " << outPath << std::endl;
+                    ok = false;
+                }
             }
         }
+        if (ok) ++done;
     }
 
-    void update(float t) {
-        float easedT = easeOutCubic(t);
-        vertexArray.clear();
+    std::cout << "Trufflified " << done << "/" << config.inputPaths.size() << " inputs." << std::endl;
+    if (resultCache) std::cout << "Result cache: " << resultCache->getHits() << " hits, " << resultCache->getMisses() << " misses." << std::endl;
+    return done == config.inputPaths.size() ? 0 : 1;
+}
+
+// one line of --serve input: "<input path> [t=0,0.5,1] [target=xmas] [out=dir]"
+struct ServeJob {
+    unsigned int id = 0;
+    std::string inputPath;
+    std::string targetName; // stem of one of the -t targets, empty = the first
+    std::string outDir;
+    std::vector<float> frames;
+    bool valid = true; // false if the line didnt parse, it still gets a failed reply
+};
 
-        for (auto& p : particles) {
-            p.currentPos = p.startPos + (p.endPos - p.startPos) * easedT;
+// a job through the worker side, the layout is empty if it failed
+struct MatchedJob {
+    ServeJob job;
+    bool ok = false;
+    size_t target = 0;
+    ParticleLayout layout;
+};
+
+bool parseServeJob(const std::string& line, const Config& config, ServeJob& job) {
+    std::stringstream ss(line);
+    std::string token;
+    job.outDir = config.outDir;
+    job.frames = config.frames.empty() ? std::vector<float>{1.0f} : config.frames;
+    while (ss >> token) {
+        if (token.compare(0, 2, "t=") == 0) {
+            // stof throws on junk like t=abc, one bad line shouldnt take the whole server down
+            try {
+                job.frames = parseFrames(token.substr(2));
+            } catch (const std::exception&) {
+                return false;
+            }
+        }
+        else if (token.compare(0, 7, "target=") == 0) job.targetName = token.substr(7);
+        else if (token.compare(0, 4, "out=") == 0) job.outDir = token.substr(4);
+        else job.inputPath += (job.inputPath.empty() ? "" : " ") + token; // paths with spaces
+    }
+    return !job.inputPath.empty() && !job.frames.empty();
+}
+
+// a long running headless mode, the targets + their indexes + the gl context are set up once
+// stdin -> jobs queue -> N matching workers (cpu only, own trufflifier each) -> matched queue ->
+// this thread, which draws + writes the frames. prints "ok <id> <file>..." or "failed <id> <input>"
+// per job, job ids are the line number so out of order replies can be matched up
+// stdout is only those replies, anything the trufflifier complains about goes to stderr
+int runServe(const Config& config) {
+    sf::RenderTexture canvas;
+    if (!canvas.create(canvasSize, canvasSize)) {
+        std::cout << "Failed to create offscreen render target." << std::endl;
+        return -1;
+    }
 
-            // keep original color, no mixing allowed
-            p.currentColor = p.startColor;
+    TargetLibrary targets;
+    if (!targets.load(config.targetPaths, config.colorSpace, config.targetCache, config.threads)) return -1;
 
-            float currentSize = p.size;
+    std::unique_ptr<ResultCache> resultCache;
+    if (config.resultCacheMb > 0) resultCache.reset(new ResultCache(config.resultCacheMb << 20));
 
-            sf::Vertex v1, v2, v3, v4;
-            v1.position = p.currentPos;
-            v2.position = sf::Vector2f(p.currentPos.x + currentSize, p.currentPos.y);
-            v3.position = sf::Vector2f(p.currentPos.x + currentSize, p.currentPos.y + currentSize);
-            v4.position = sf::Vector2f(p.currentPos.x, p.currentPos.y + currentSize);
+    // split the cores between the workers so they dont all fight over every one
+    unsigned int workerCount = std::max(1u, config.workers);
+    unsigned int cores = config.threads ? config.threads : std::max(1u, std::thread::hardware_concurrency());
+    unsigned int threadsEach = std::max(1u, cores / workerCount);
 
-            v1.color = p.currentColor;
-            v2.color = p.currentColor;
-            v3.color = p.currentColor;
-            v4.color = p.currentColor;
+    BoundedQueue<ServeJob> jobs(workerCount * 2);
+    BoundedQueue<MatchedJob> matched(workerCount * 2);
 
-            vertexArray.append(v1);
-            vertexArray.append(v2);
-            vertexArray.append(v3);
-            vertexArray.append(v4);
+    std::thread reader([&]() {
+        std::string line;
+        unsigned int id = 0;
+        while (std::getline(std::cin, line)) {
+            ServeJob job;
+            job.id = ++id;
+            if (line.find_first_not_of(" \t\r") == std::string::npos) continue; // blank, nobody is waiting on it
+            job.valid = parseServeJob(line, config, job);
+            jobs.push(std::move(job));
         }
+        jobs.close();
+    });
+
+    std::atomic<unsigned int> running{workerCount};
+    std::vector<std::thread> pool;
+    for (unsigned int w = 0; w < workerCount; ++w) {
+        pool.emplace_back([&]() {
+            Trufflifier app;
+            applyConfig(app, config);
+            app.setThreadCount(threadsEach);
+            app.setResultCache(resultCache.get());
+
+            ServeJob job;
+            while (jobs.pop(job)) {
+                MatchedJob out;
+                out.job = std::move(job);
+
+                // no target= is the first one, a name that isnt loaded fails the job
+                bool found = out.job.targetName.empty();
+                for (size_t i = 0; i < targets.size() && !found; ++i) {
+                    if (std::filesystem::path(targets.get(i)->path).stem().string() == out.job.targetName) {
+                        out.target = i;
+                        found = true;
+                    }
+                }
+
+                if (out.job.valid && found && app.loadInput(out.job.inputPath)) {
+                    app.setTarget(targets.get(out.target));
+                    app.matchParticles(canvasSize, canvasSize);
+                    out.layout = app.takeLayout();
+                    out.ok = true;
+                }
+                matched.push(std::move(out));
+            }
+
+            // last one out tells the render side there is nothing more coming
+            if (--running == 0) matched.close();
+        });
     }
 
-    void draw(sf::RenderWindow& window) {
-        window.draw(vertexArray);
+    Trufflifier renderer;
+    applyConfig(renderer, config);
+    OutputNames names;
+
+    MatchedJob item;
+    while (matched.pop(item)) {
+        if (!item.ok) {
+            std::cout << "failed " << item.job.id << " " << item.job.inputPath << std::endl;
+            continue;
+        }
+
+        std::error_code ec;
+        std::filesystem::create_directories(item.job.outDir, ec);
+        std::string targetName = targets.size() > 1 ? std::filesystem::path(targets.get(item.target)->path).stem().string() : "";
+
+        std::string inputName = names.get(item.job.outDir, item.job.inputPath, item.job.id);
+        renderer.setLayout(std::move(item.layout), canvasSize, canvasSize);
+        std::string written;
+        bool ok = true;
+        for (float t : item.job.frames) {
+            renderer.update(t);
+            canvas.clear(backgroundColor);
+            renderer.draw(canvas);
+            canvas.display();
+
+            std::string outPath = framePath(item.job.outDir, inputName, targetName, t);
+            if (!canvas.getTexture().copyToImage().saveToFile(outPath)) ok = false;
+            written += " " + outPath;
+        }
+        std::cout << (ok ? "ok " : "failed ") << item.job.id << written << std::endl;
     }
-};
+
+    reader.join();
+    for (auto& th : pool) th.join();
+    return 0;
+}
 
 int main(int argc, char* argv[]) {
     Config config;
 
     for (int i = 1; i < argc; ++i) {
         std::string arg = argv[i];
-        if (arg == "-f" && i + 1 < argc) config.inputPath = argv[i + 1];
+        if (arg == "-f" && i + 1 < argc) config.inputPaths.push_back(argv[i + 1]);
+        if (arg == "-t" && i + 1 < argc) config.targetPaths.push_back(argv[i + 1]);
+        if (arg == "--list" && i + 1 < argc && !readInputList(argv[i + 1], config.inputPaths)) return 1;
+        if (arg == "--unique") config.uniqueMatch = true;
+        if (arg == "--coarse") config.coarseMatch = true;
+        if (arg == "--oklab") config.colorSpace = ColorSpace::OkLab;
+        if (arg == "--seed" && i + 1 < argc && !parseNumber(arg, argv[i + 1], 0LL, config.seed)) return 1;
+        if (arg == "--threads" && i + 1 < argc && !parseNumber(arg, argv[i + 1], 0u, config.threads)) return 1;
+        if (arg == "--gpu") config.renderMode = RenderMode::Shader;
+        if (arg == "--points") config.renderMode = RenderMode::Points;
+        if (arg == "--headless") config.headless = true;
+        if (arg == "--serve") config.serve = true;
+        if (arg == "--workers" && i + 1 < argc && !parseNumber(arg, argv[i + 1], 1u, config.workers)) return 1;
+        if (arg == "--no-cache") config.targetCache = false;
+        if (arg == "--result-cache" && i + 1 < argc && !parseNumber(arg, argv[i + 1], (size_t)0, config.resultCacheMb)) return 1;
+        if (arg == "--frames" && i + 1 < argc) {
+            try {
+                config.frames = parseFrames(argv[i + 1]);
+            } catch (const std::exception&) {
+                std::cout << "Bad --frames " << argv[i + 1] << ", wants something like 0,0.5,1." << std::endl;
+                return 1;
+            }
+        }
+        if (arg == "--out" && i + 1 < argc) config.outDir = argv[i + 1];
+        if (arg == "--export" && i + 1 < argc) config.exportPath = argv[i + 1];
+        if (arg == "--fps" && i + 1 < argc && !parseNumber(arg, argv[i + 1], 1u, config.fps)) return 1;
+        if (arg == "--particles" && i + 1 < argc && !parseNumber(arg, argv[i + 1], 1.0f, config.maxParticles)) return 1;
+        if (arg == "--framerate" && i + 1 < argc && !parseNumber(arg, argv[i + 1], 0u, config.framerateLimit)) return 1;
+        if (arg == "--adaptive" && i + 1 < argc && !parseNumber(arg, argv[i + 1], 0.1f, config.adaptiveMs)) return 1;
+        if (arg == "--profile" && i + 1 < argc) config.profilePath = argv[i + 1];
+        if (arg == "--no-idle") config.idleWait = false;
+        if (arg == "--ease" && i + 1 < argc && !parseEasing(argv[i + 1], config.animation)) {
+            std::cout << "Unknown easing " << argv[i + 1] << ", ignoring it." << std::endl;
+        }
+        if (arg == "--stagger" && i + 1 < argc) {
+            std::string mode = argv[i + 1];
+            if (mode == "random") config.animation.stagger = Stagger::Random;
+            if (mode == "sweep") config.animation.stagger = Stagger::Sweep;
+        }
+        if (arg == "--stagger-amount" && i + 1 < argc && !parseNumber(arg, argv[i + 1], 0.0f, config.animation.staggerAmount)) return 1;
+        if (arg == "--order" && i + 1 < argc) {
+            std::string order = argv[i + 1];
+            if (order == "end") config.order = ParticleOrder::End;
+            if (order == "middle") config.order = ParticleOrder::Middle;
+        }
+        if (arg == "--arc" && i + 1 < argc && !parseNumber(arg, argv[i + 1], 0.0f, config.animation.arc)) return 1;
+        if (arg == "--window" && i + 1 < argc && !parseSize(argv[i + 1], config.windowWidth, config.windowHeight)) return 1;
+        if (arg == "--virtual" && i + 1 < argc && !parseSize(argv[i + 1], config.virtualWidth, config.virtualHeight)) return 1;
+        if (arg == "--supersample" && i + 1 < argc && !parseNumber(arg, argv[i + 1], 1u, config.supersample)) return 1;
     }
 
-    if (config.inputPath.empty()) {
-        std::cout << "Usage: trufflify.exe -f \"image.png\"" << std::endl;
+    if (config.targetPaths.empty()) config.targetPaths.push_back("truffle.png");
+
+    if (config.inputPaths.empty() && !config.serve) {
+        std::cout << "Usage: trufflify.exe -f \"image.png\" [-t target.png ...] [--unique | --coarse] [--oklab] [--threads n] [--seed n]" << std::endl;
+        std::cout << "       [--gpu | --points] [--no-cache]" << std::endl;
+        std::cout << "       [--particles 15000] [--framerate 60] [--adaptive 16.6] [--profile out.csv] [--no-idle]" << std::endl;
+        std::cout << "       [--ease cubic|linear|inout|back|x1,y1,x2,y2] [--stagger random|sweep] [--stagger-amount 0.3] [--arc 0.3]" << std::endl;
+        std::cout << "       [--order end|middle] [--window 800x800] [--virtual 800x800] [--supersample 2]" << std::endl;
+        std::cout << "       trufflify.exe --headless (-f \"image.png\" ... | --list inputs.txt) [--frames 0,0.5,1] [--out dir]" << std::endl;
+        std::cout << "       [--seed n --result-cache 256]" << std::endl;
+        std::cout << "       trufflify.exe --serve [--workers 2] [-t target.png ...] [--out dir] < jobs" << std::endl;
+        std::cout << "       trufflify.exe -f \"image.png\" --export out.mp4|out.gif|frames/%04d.png [--fps 60]" << std::endl;
         return 1;
     }
 
-    sf::RenderWindow window(sf::VideoMode(800, 800), "Trufflify");
-    window.setFramerateLimit(60);
+    if (!config.exportPath.empty()) return runExport(config);
+    if (config.serve) return runServe(config);
+    if (config.headless) return runHeadless(config);
+
+    sf::RenderWindow window(sf::VideoMode(config.windowWidth, config.windowHeight), "Trufflify");
+    window.setFramerateLimit(config.framerateLimit);
+
+    // supersampling needs a fixed canvas to draw offscreen, the starting window size it is
+    std::unique_ptr<VirtualCanvas> canvas;
+    if (config.virtualWidth > 0) {
+        canvas.reset(new VirtualCanvas(config.virtualWidth, config.virtualHeight, config.supersample));
+    } else if (config.supersample > 1) {
+        canvas.reset(new VirtualCanvas(window.getSize().x, window.getSize().y, config.supersample));
+    }
+    if (canvas) canvas->resize(window.getSize().x, window.getSize().y);
+
+    // what the particles get laid out on, the window itself unless there is a canvas
+    auto layoutSize = [&]() {
+        return canvas ? canvas->getSize() : window.getSize();
+    };
+
+    // flipping back to a target (or window size) seen before skips the rematch
+    std::unique_ptr<ResultCache> resultCache;
+    if (config.resultCacheMb > 0) resultCache.reset(new ResultCache(config.resultCacheMb << 20));
 
     Trufflifier app;
-    if (!app.load(config.inputPath, config.targetPath)) return -1;
+    applyConfig(app, config);
+    app.setResultCache(resultCache.get());
+    if (!app.loadInput(config.inputPaths.front())) return -1;
+    if (config.seed < 0) std::cout << "Seed " << app.getSeed() << ", --seed " << app.getSeed() << " gets this layout again." << std::endl;
 
-    app.initParticles(window.getSize().x, window.getSize().y);
+    // every target gets loaded + indexed now, T just flips between them
+    TargetLibrary targets;
+    if (!targets.load(config.targetPaths, config.colorSpace, config.targetCache, config.threads)) return -1;
+    size_t currentTarget = 0;
+    app.setTarget(targets.get(currentTarget));
+
+    // matching runs in the background, the loop below shows it filling in
+    app.startInit(layoutSize().x, layoutSize().y);
 
     sf::Clock clock;
-    float duration = 3.0f; // 3 seconds seems about right
     bool isRunning = false;
 
-    while (window.isOpen()) {
-        sf::Event event;
-        while (window.pollEvent(event)) {
-            if (event.type == sf::Event::Closed) window.close();
-            if (event.type == sf::Event::KeyPressed) {
-                if (event.key.code == sf::Keyboard::Escape) window.close();
-
-                if (event.key.code == sf::Keyboard::Enter) {
-                    if (!isRunning) {
-                        isRunning = true;
-                        clock.restart();
-                    } else {
-                        window.close();
-                    }
-                }
+    std::unique_ptr<AdaptiveQuality> adaptive;
+    if (config.adaptiveMs > 0.0f) adaptive.reset(new AdaptiveQuality(config.adaptiveMs, config.maxParticles));
+
+    // F3 toggles the overlay
+    Profiler profiler;
+    bool showProfiler = !config.profilePath.empty();
+    if (!config.profilePath.empty() && !profiler.openCsv(config.profilePath)) return -1;
+    Stopwatch frameWatch, phaseWatch;
 
-                if (event.key.code == sf::Keyboard::R && isRunning) {
+    // only draw when something changed, idle windows sit in waitEvent instead of spinning at 60fps
+    bool redraw = true;
+    float lastProgress = -1.0f;
+    bool idleWait = config.idleWait && config.profilePath.empty(); // a csv wants every frame
+
+    auto handleEvent = [&](const sf::Event& event) {
+        if (event.type == sf::Event::Closed) window.close();
+        if (event.type == sf::Event::Resized) {
+            if (canvas) {
+                // same layout, just a different scale
+                canvas->resize(event.size.width, event.size.height);
+            } else {
+                // 1:1 pixels instead of stretching the old view, particles keep their targets
+                window.setView(sf::View(sf::FloatRect(0.0f, 0.0f, (float)event.size.width, (float)event.size.height)));
+                app.resize(event.size.width, event.size.height);
+            }
+            redraw = true;
+        }
+        // sfml has no expose event, coming back into focus is the closest thing
+        if (event.type == sf::Event::GainedFocus) redraw = true;
+        if (event.type == sf::Event::KeyPressed) {
+            if (event.key.code == sf::Keyboard::Escape) window.close();
+
+            if (event.key.code == sf::Keyboard::Enter) {
+                if (!isRunning) {
+                    isRunning = true;
                     clock.restart();
+                } else {
+                    window.close();
                 }
             }
+
+            if (event.key.code == sf::Keyboard::R && isRunning) {
+                clock.restart();
+            }
+
+            if (event.key.code == sf::Keyboard::T && targets.size() > 1) {
+                currentTarget = (currentTarget + 1) % targets.size();
+                app.setTarget(targets.get(currentTarget));
+                app.startInit(layoutSize().x, layoutSize().y);
+                clock.restart();
+            }
+
+            if (event.key.code == sf::Keyboard::F3) showProfiler = !showProfiler;
+            redraw = true;
+        }
+    };
+
+    while (window.isOpen()) {
+        sf::Event event;
+        bool moving = (isRunning && lastProgress < 1.0f) || app.isInitializing();
+        if (idleWait && !redraw && !moving) {
+            if (window.waitEvent(event)) handleEvent(event);
+            frameWatch.restart(); // the nap isnt frame time
         }
+        while (window.pollEvent(event)) handleEvent(event);
+        if (!window.isOpen()) break;
 
         float progress = 0.0f;
         if (isRunning) {
             float time = clock.getElapsedTime().asSeconds();
-            progress = std::min(time / duration, 1.0f);
+            progress = std::min(time / animationDuration, 1.0f);
         }
 
+        // the poll that finishes the init swaps buffers too, so that frame still counts as a change
+        if (app.isInitializing()) redraw = true;
+        bool initializing = app.pollInit();
+        if (idleWait && !redraw && progress == lastProgress) continue;
+        redraw = false;
+        lastProgress = progress;
+
+        Profiler::Frame frame;
+        window.clear(backgroundColor);
+
+        phaseWatch.restart();
         app.update(progress);
+        frame.updateMs = phaseWatch.ms();
 
-        window.clear(sf::Color(20, 20, 30));
-        app.draw(window);
+        phaseWatch.restart();
+        if (canvas) {
+            app.draw(canvas->begin(window));
+            canvas->finish(window);
+        } else {
+            app.draw(window);
+        }
+        frame.drawMs = phaseWatch.ms();
+
+        if (showProfiler) drawProfilerOverlay(window, profiler, app.getInitTimes());
+
+        phaseWatch.restart();
         window.display();
+        frame.displayMs = phaseWatch.ms();
+
+        frame.frameMs = frameWatch.ms();
+        frameWatch.restart();
+        frame.particles = app.getParticleCount();
+        frame.vertices = app.getUploadedVertexCount();
+        profiler.addFrame(frame, app.getInitTimes());
+
+        // half revealed frames say nothing about the real cost
+        if (adaptive && !initializing && adaptive->addFrame((float)(frame.updateMs + frame.drawMs)) && app.setParticleBudget(adaptive->getBudget())) {
+            app.startInit(layoutSize().x, layoutSize().y);
+        }
     }
     return 0;
-}
\ No newline at end of file
+}
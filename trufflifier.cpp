@@ -0,0 +1,2050 @@
+#include "trufflifier.hpp"
+
+#include <iostream>
+#include <cmath>
+#include <limits>
+#include <thread>
+#include <atomic>
+#include <fstream>
+#include <filesystem>
+#include <bitset>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+unsigned int sampleStep(unsigned int w, unsigned int h, float maxParticles) {
+    float ratio = std::sqrt(maxParticles / ((float)w * h));
+    unsigned int widest = std::max(1u, std::max(w, h));
+    // no budget (or nan from a negative one), a single sample is as few as it gets
+    if (!(ratio > 0.0f)) return widest;
+    // skip pixels if too many
+    unsigned int step = 1;
+    if (ratio < 1.0f) {
+        step = (unsigned int)std::min(1.0f / ratio, (float)widest);
+    }
+    return step;
+}
+
+std::uint64_t hashBytes(const void* data, size_t size, std::uint64_t hash) {
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// srgb byte -> linear light, built on first use
+const float* srgbToLinearTable() {
+    static const std::vector<float> table = [] {
+        std::vector<float> t(256);
+        for (int i = 0; i < 256; ++i) {
+            float c = i / 255.0f;
+            t[i] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+        }
+        return t;
+    }();
+    return table.data();
+}
+
+int matchColorBits(ColorSpace space) {
+    return space == ColorSpace::OkLab ? 9 : 8;
+}
+
+MatchColor toMatchColor(const sf::Color& color, ColorSpace space) {
+    if (space == ColorSpace::Rgb) return {{color.r, color.g, color.b}};
+
+    // linear srgb -> lms -> oklab, matrices straight from the oklab post
+    const float* lin = srgbToLinearTable();
+    float r = lin[color.r], g = lin[color.g], b = lin[color.b];
+
+    float l = std::cbrt(0.4122214708f * r + 0.5363325363f * g + 0.0514459929f * b);
+    float m = std::cbrt(0.2119034982f * r + 0.6806995451f * g + 0.1073969566f * b);
+    float s = std::cbrt(0.0883024619f * r + 0.2817188376f * g + 0.6299787005f * b);
+
+    float L = 0.2104542553f * l + 0.7936177850f * m - 0.0040720468f * s;
+    float A = 1.9779984951f * l - 2.4285922050f * m + 0.4505937099f * s;
+    float B = 0.0259040371f * l + 0.7827717662f * m - 0.8086757660f * s;
+
+    // L is 0..1, a + b stay inside about -0.32..0.28 for anything srgb can show
+    return {{(int)std::lround(L * 400.0f), (int)std::lround((A + 0.4f) * 400.0f), (int)std::lround((B + 0.4f) * 400.0f)}};
+}
+
+bool MappedFile::open(const std::string& path) {
+    close();
+#ifdef _WIN32
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+        close();
+        return false;
+    }
+    mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping) {
+        close();
+        return false;
+    }
+    ptr = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    length = (size_t)size.QuadPart;
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+    void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd); // the mapping keeps the file alive
+    if (p == MAP_FAILED) return false;
+    ptr = (const char*)p;
+    length = (size_t)st.st_size;
+#endif
+    if (!ptr) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void MappedFile::close() {
+#ifdef _WIN32
+    if (ptr) UnmapViewOfFile(ptr);
+    if (mapping) CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+    mapping = nullptr;
+    file = INVALID_HANDLE_VALUE;
+#else
+    if (ptr) munmap((void*)ptr, length);
+#endif
+    ptr = nullptr;
+    length = 0;
+}
+
+void ColorIndex::build(int lo, int hi) {
+    if (hi - lo <= 1) return;
+
+    // split on whichever channel is most spread out, oklab channels go past 255
+    int minC[3] = {std::numeric_limits<int>::max(), std::numeric_limits<int>::max(), std::numeric_limits<int>::max()};
+    int maxC[3] = {std::numeric_limits<int>::min(), std::numeric_limits<int>::min(), std::numeric_limits<int>::min()};
+    for (int i = lo; i < hi; ++i) {
+        for (int k = 0; k < 3; ++k) {
+            minC[k] = std::min(minC[k], nodes[i].c[k]);
+            maxC[k] = std::max(maxC[k], nodes[i].c[k]);
+        }
+    }
+    int axis = 0;
+    for (int k = 1; k < 3; ++k) {
+        if (maxC[k] - minC[k] > maxC[axis] - minC[axis]) axis = k;
+    }
+
+    int mid = (lo + hi) / 2;
+    std::nth_element(nodes.begin() + lo, nodes.begin() + mid, nodes.begin() + hi,
+        [axis](const Node& a, const Node& b) { return a.c[axis] < b.c[axis]; });
+    nodes[mid].axis = axis;
+
+    build(lo, mid);
+    build(mid + 1, hi);
+}
+
+void ColorIndex::search(int lo, int hi, const int q[3], int& best, long long& bestDist) const {
+    if (lo >= hi) return;
+
+    int mid = (lo + hi) / 2;
+    const Node& n = nodes[mid];
+
+    long long dr = q[0] - n.c[0];
+    long long dg = q[1] - n.c[1];
+    long long db = q[2] - n.c[2];
+    long long d = dr*dr + dg*dg + db*db;
+    if (d < bestDist) {
+        bestDist = d;
+        best = mid;
+    }
+    if (hi - lo == 1) return;
+
+    // closer side first, other side only if the split plane is in range
+    long long planeDist = q[n.axis] - n.c[n.axis];
+    if (planeDist < 0) {
+        search(lo, mid, q, best, bestDist);
+        if (planeDist * planeDist < bestDist) search(mid + 1, hi, q, best, bestDist);
+    } else {
+        search(mid + 1, hi, q, best, bestDist);
+        if (planeDist * planeDist < bestDist) search(lo, mid, q, best, bestDist);
+    }
+}
+
+void ColorIndex::build(const std::vector<TargetTexel>& targetPixels, ColorSpace colorSpace) {
+    space = colorSpace;
+    nodes.clear();
+    groupStart.clear();
+    members.clear();
+
+    // sort pixel indices by packed rgb so equal colours end up next to each other
+    members.resize(targetPixels.size());
+    for (size_t i = 0; i < members.size(); ++i) members[i] = (int)i;
+
+    auto key = [&](int i) {
+        const sf::Color& c = targetPixels[i].color;
+        return ((unsigned int)c.r << 16) | ((unsigned int)c.g << 8) | c.b;
+    };
+    std::sort(members.begin(), members.end(), [&](int a, int b) {
+        unsigned int ka = key(a), kb = key(b);
+        return ka != kb ? ka < kb : a < b;
+    });
+
+    for (size_t i = 0; i < members.size(); ++i) {
+        if (i == 0 || key(members[i]) != key(members[i - 1])) {
+            // converted once here, queries only compare
+            MatchColor c = toMatchColor(targetPixels[members[i]].color, space);
+            nodes.push_back({{c.c[0], c.c[1], c.c[2]}, 0, (int)groupStart.size()});
+            groupStart.push_back((int)i);
+        }
+    }
+    groupStart.push_back((int)members.size());
+
+    build(0, (int)nodes.size());
+}
+
+void ColorIndex::save(std::vector<char>& out) const {
+    writeArray(out, nodes);
+    writeArray(out, groupStart);
+    writeArray(out, members);
+}
+
+bool ColorIndex::load(const char*& p, const char* end, ColorSpace colorSpace, size_t pixelCount) {
+    space = colorSpace;
+    if (!readArray(p, end, nodes) || !readArray(p, end, groupStart) || !readArray(p, end, members)) return false;
+
+    // a stale or corrupt file with a matching hash would read out of bounds in nearest/member,
+    // so every index gets checked once here. groups are non empty ranges that tile members
+    int groups = (int)nodes.size();
+    if (groupStart.size() != nodes.size() + 1 || groupStart.front() != 0) return false;
+    if ((size_t)groupStart.back() != members.size()) return false;
+    for (int g = 0; g < groups; ++g) {
+        if (groupStart[g + 1] <= groupStart[g]) return false;
+    }
+    for (const Node& n : nodes) {
+        if (n.group < 0 || n.group >= groups || n.axis < 0 || n.axis > 2) return false;
+    }
+    for (int m : members) {
+        if (m < 0 || (size_t)m >= pixelCount) return false;
+    }
+    return true;
+}
+
+int ColorIndex::nearest(const MatchColor& c) const {
+    if (nodes.empty()) return -1;
+
+    int q[3] = {c.c[0], c.c[1], c.c[2]};
+    int best = 0;
+    long long bestDist = std::numeric_limits<long long>::max();
+    search(0, (int)nodes.size(), q, best, bestDist);
+    return nodes[best].group;
+}
+
+static long long matchDist(const int a[3], const int b[3]) {
+    long long d0 = a[0] - b[0];
+    long long d1 = a[1] - b[1];
+    long long d2 = a[2] - b[2];
+    return d0*d0 + d1*d1 + d2*d2;
+}
+
+void ColorPalette::build(const ColorIndex& index) {
+    entries.resize(index.colorCount());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const int* c = index.colorAt(i);
+        entries[i] = {{c[0], c[1], c[2]}, index.colorGroup(i)};
+    }
+    clusterStart.clear();
+    centres.clear();
+    if (entries.empty()) return;
+
+    // median cut, keep splitting whichever cluster is most spread out down the middle of
+    // its widest channel. sqrt(n) clusters makes the centre scan and the member scan about equal
+    struct Range {
+        int lo, hi, axis, spread;
+    };
+    auto measure = [&](int lo, int hi) {
+        Range r = {lo, hi, 0, 0};
+        int minC[3] = {std::numeric_limits<int>::max(), std::numeric_limits<int>::max(), std::numeric_limits<int>::max()};
+        int maxC[3] = {std::numeric_limits<int>::min(), std::numeric_limits<int>::min(), std::numeric_limits<int>::min()};
+        for (int i = lo; i < hi; ++i) {
+            for (int k = 0; k < 3; ++k) {
+                minC[k] = std::min(minC[k], entries[i].c[k]);
+                maxC[k] = std::max(maxC[k], entries[i].c[k]);
+            }
+        }
+        for (int k = 0; k < 3; ++k) {
+            if (maxC[k] - minC[k] > r.spread) {
+                r.spread = maxC[k] - minC[k];
+                r.axis = k;
+            }
+        }
+        return r;
+    };
+
+    size_t wanted = std::min<size_t>(1024, std::max<size_t>(1, (size_t)std::sqrt((double)entries.size())));
+    std::vector<Range> ranges = {measure(0, (int)entries.size())};
+    while (ranges.size() < wanted) {
+        size_t widest = 0;
+        for (size_t i = 1; i < ranges.size(); ++i) {
+            if (ranges[i].spread > ranges[widest].spread) widest = i;
+        }
+        Range r = ranges[widest];
+        if (r.spread == 0) break; // every cluster is down to one colour
+
+        int axis = r.axis;
+        int mid = (r.lo + r.hi) / 2;
+        std::nth_element(entries.begin() + r.lo, entries.begin() + mid, entries.begin() + r.hi,
+            [axis](const Entry& a, const Entry& b) { return a.c[axis] < b.c[axis]; });
+        ranges[widest] = measure(r.lo, mid);
+        ranges.push_back(measure(mid, r.hi));
+    }
+
+    std::sort(ranges.begin(), ranges.end(), [](const Range& a, const Range& b) { return a.lo < b.lo; });
+    for (const Range& r : ranges) {
+        long long sum[3] = {0, 0, 0};
+        for (int i = r.lo; i < r.hi; ++i) {
+            for (int k = 0; k < 3; ++k) sum[k] += entries[i].c[k];
+        }
+        int n = r.hi - r.lo;
+        centres.push_back({{(int)(sum[0] / n), (int)(sum[1] / n), (int)(sum[2] / n)}});
+        clusterStart.push_back(r.lo);
+    }
+    clusterStart.push_back((int)entries.size());
+}
+
+int ColorPalette::nearestCluster(const MatchColor& c) const {
+    if (centres.empty()) return -1;
+
+    int best = 0;
+    long long bestDist = std::numeric_limits<long long>::max();
+    for (size_t k = 0; k < centres.size(); ++k) {
+        long long d = matchDist(c.c, centres[k].c);
+        if (d < bestDist) {
+            bestDist = d;
+            best = (int)k;
+        }
+    }
+    return best;
+}
+
+int ColorPalette::nearestInCluster(int cluster, const MatchColor& c) const {
+    int best = clusterStart[cluster];
+    long long bestDist = std::numeric_limits<long long>::max();
+    for (int i = clusterStart[cluster]; i < clusterStart[cluster + 1]; ++i) {
+        long long d = matchDist(c.c, entries[i].c);
+        if (d < bestDist) {
+            bestDist = d;
+            best = i;
+        }
+    }
+    return entries[best].group;
+}
+
+void parallelFor(unsigned int count, unsigned int threads, const std::function<void(unsigned int)>& fn) {
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min(threads, count);
+
+    if (threads <= 1) {
+        for (unsigned int i = 0; i < count; ++i) fn(i);
+        return;
+    }
+
+    std::atomic<unsigned int> next{0};
+    auto worker = [&]() {
+        for (unsigned int i = next++; i < count; i = next++) fn(i);
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned int i = 1; i < threads; ++i) pool.emplace_back(worker);
+    worker();
+    for (auto& th : pool) th.join();
+}
+
+void radixSort(std::vector<std::uint32_t>& keys, std::vector<std::uint32_t>& values,
+               std::vector<std::uint32_t>& tmpKeys, std::vector<std::uint32_t>& tmpValues, unsigned int threads) {
+    size_t n = keys.size();
+    tmpKeys.resize(n);
+    tmpValues.resize(n);
+    if (n < 2) return;
+
+    // small sorts arent worth the threads
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    unsigned int chunks = (unsigned int)std::min<size_t>(threads, n / 16384 + 1);
+    size_t chunkSize = (n + chunks - 1) / chunks;
+    std::vector<size_t> offsets((size_t)chunks * 256);
+
+    for (int shift = 0; shift < 32; shift += 8) {
+        std::fill(offsets.begin(), offsets.end(), 0);
+        parallelFor(chunks, threads, [&](unsigned int c) {
+            size_t* hist = &offsets[(size_t)c * 256];
+            for (size_t i = c * chunkSize, end = std::min(n, i + chunkSize); i < end; ++i) ++hist[(keys[i] >> shift) & 255];
+        });
+
+        // digit by digit, chunk by chunk inside it, thats what keeps equal keys in order
+        size_t sum = 0;
+        bool oneDigit = false;
+        for (int d = 0; d < 256 && !oneDigit; ++d) {
+            size_t digitTotal = 0;
+            for (unsigned int c = 0; c < chunks; ++c) {
+                size_t& o = offsets[(size_t)c * 256 + d];
+                size_t count = o;
+                o = sum;
+                sum += count;
+                digitTotal += count;
+            }
+            oneDigit = digitTotal == n;
+        }
+        if (oneDigit) continue;
+
+        parallelFor(chunks, threads, [&](unsigned int c) {
+            size_t* next = &offsets[(size_t)c * 256];
+            for (size_t i = c * chunkSize, end = std::min(n, i + chunkSize); i < end; ++i) {
+                size_t o = next[(keys[i] >> shift) & 255]++;
+                tmpKeys[o] = keys[i];
+                tmpValues[o] = values[i];
+            }
+        });
+        keys.swap(tmpKeys);
+        values.swap(tmpValues);
+    }
+}
+
+// 16 bits spread out to every other bit
+static std::uint32_t spreadBits(std::uint32_t v) {
+    v &= 0xFFFF;
+    v = (v | (v << 8)) & 0x00FF00FF;
+    v = (v | (v << 4)) & 0x0F0F0F0F;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+std::uint32_t mortonKey(std::uint32_t x, std::uint32_t y) {
+    return spreadBits(x) | (spreadBits(y) << 1);
+}
+
+// adds up r*a, g*a, b*a and a over a run of rgba pixels
+// sse2 does 4 pixels a go: widen to 16 bit, multiply by alpha (255*255 still fits), widen + add
+inline void sumPixels(const sf::Uint8* p, const sf::Uint8* end, std::uint32_t sums[4]) {
+    std::uint32_t r = 0, g = 0, b = 0, a = 0;
+#ifdef TRUFFLIFY_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rgbMask = _mm_setr_epi16(-1, -1, -1, 0, -1, -1, -1, 0);
+    const __m128i alphaOne = _mm_setr_epi16(0, 0, 0, 1, 0, 0, 0, 1);
+    __m128i acc = _mm_setzero_si128();
+
+    for (; p + 16 <= end; p += 16) {
+        __m128i px = _mm_loadu_si128((const __m128i*)p);
+        __m128i lo = _mm_unpacklo_epi8(px, zero); // pixel 0 + 1 as 16 bit
+        __m128i hi = _mm_unpackhi_epi8(px, zero); // pixel 2 + 3
+
+        // (a, a, a, 1) per pixel so the alpha lane just passes through
+        __m128i loA = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, 0xFF), 0xFF);
+        __m128i hiA = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, 0xFF), 0xFF);
+        loA = _mm_or_si128(_mm_and_si128(loA, rgbMask), alphaOne);
+        hiA = _mm_or_si128(_mm_and_si128(hiA, rgbMask), alphaOne);
+
+        lo = _mm_mullo_epi16(lo, loA);
+        hi = _mm_mullo_epi16(hi, hiA);
+
+        acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(lo, zero));
+        acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(lo, zero));
+        acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(hi, zero));
+        acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(hi, zero));
+    }
+
+    alignas(16) std::uint32_t lanes[4];
+    _mm_store_si128((__m128i*)lanes, acc);
+    r = lanes[0];
+    g = lanes[1];
+    b = lanes[2];
+    a = lanes[3];
+#endif
+    for (; p < end; p += 4) {
+        std::uint32_t pa = p[3];
+        r += p[0] * pa;
+        g += p[1] * pa;
+        b += p[2] * pa;
+        a += pa;
+    }
+    sums[0] += r;
+    sums[1] += g;
+    sums[2] += b;
+    sums[3] += a;
+}
+
+void downsampleImage(const sf::Image& image, unsigned int step, unsigned int threads, SampledImage& out) {
+    out.width = image.getSize().x;
+    out.height = image.getSize().y;
+    out.step = step;
+    out.cols = (out.width + step - 1) / step;
+    out.rows = (out.height + step - 1) / step;
+
+    out.pixels.clear();
+    out.pixels.shrink_to_fit(); // the last batch item might have been way bigger
+    out.pixels.resize((size_t)out.cols * out.rows);
+    if (out.pixels.empty()) return;
+
+    const sf::Uint8* src = image.getPixelsPtr();
+    size_t stride = (size_t)out.width * 4;
+
+    parallelFor(out.rows, threads, [&](unsigned int row) {
+        unsigned int yBegin = row * step;
+        unsigned int yEnd = std::min(out.height, yBegin + step);
+
+        // r*a, g*a, b*a, a per cell, summed over every source row in this cell row
+        // 32 bit is enough for one row of one cell, the cell totals need 64
+        std::vector<std::uint64_t> sums((size_t)out.cols * 4, 0);
+
+        for (unsigned int y = yBegin; y < yEnd; ++y) {
+            const sf::Uint8* line = src + y * stride;
+            for (unsigned int col = 0; col < out.cols; ++col) {
+                unsigned int xBegin = col * step;
+                unsigned int xEnd = std::min(out.width, xBegin + step);
+
+                std::uint32_t rowSums[4] = {0, 0, 0, 0};
+                sumPixels(line + xBegin * 4, line + xEnd * 4, rowSums);
+
+                std::uint64_t* cell = &sums[(size_t)col * 4];
+                cell[0] += rowSums[0];
+                cell[1] += rowSums[1];
+                cell[2] += rowSums[2];
+                cell[3] += rowSums[3];
+            }
+        }
+
+        for (unsigned int col = 0; col < out.cols; ++col) {
+            const std::uint64_t* cell = &sums[(size_t)col * 4];
+            std::uint64_t area = (std::uint64_t)(yEnd - yBegin) * (std::min(out.width, (col + 1) * step) - col * step);
+
+            sf::Color c(0, 0, 0, 0);
+            if (cell[3] > 0) {
+                c.r = (sf::Uint8)((cell[0] + cell[3] / 2) / cell[3]);
+                c.g = (sf::Uint8)((cell[1] + cell[3] / 2) / cell[3]);
+                c.b = (sf::Uint8)((cell[2] + cell[3] / 2) / cell[3]);
+                c.a = (sf::Uint8)((cell[3] + area / 2) / area);
+                if (c.a == 0) c.a = 1; // barely there still counts, only fully empty cells get skipped
+            }
+            out.pixels[(size_t)row * out.cols + col] = c;
+        }
+    });
+}
+
+// bit k set if pixel k of the 16 at p has alpha > 0
+#ifdef TRUFFLIFY_SSE2
+static inline unsigned int opaqueMask16(const sf::Uint8* p) {
+    // alpha is the top byte of every 32 bit pixel, pack the 16 of them down into one register
+    __m128i a0 = _mm_srli_epi32(_mm_loadu_si128((const __m128i*)p), 24);
+    __m128i a1 = _mm_srli_epi32(_mm_loadu_si128((const __m128i*)(p + 16)), 24);
+    __m128i a2 = _mm_srli_epi32(_mm_loadu_si128((const __m128i*)(p + 32)), 24);
+    __m128i a3 = _mm_srli_epi32(_mm_loadu_si128((const __m128i*)(p + 48)), 24);
+    __m128i alphas = _mm_packus_epi16(_mm_packs_epi32(a0, a1), _mm_packs_epi32(a2, a3));
+    __m128i clear = _mm_cmpeq_epi8(alphas, _mm_setzero_si128());
+    return ~(unsigned int)_mm_movemask_epi8(clear) & 0xFFFF;
+}
+#endif
+
+// texels for one row starting at out, or just the count if out is null
+static size_t opaqueRow(const sf::Uint8* line, unsigned int width, unsigned int y, TargetTexel* out) {
+    size_t count = 0;
+    unsigned int x = 0;
+#ifdef TRUFFLIFY_SSE2
+    for (; x + 16 <= width; x += 16) {
+        unsigned int mask = opaqueMask16(line + (size_t)x * 4);
+        if (mask == 0) continue;
+        if (!out) {
+            count += std::bitset<16>(mask).count();
+            continue;
+        }
+        for (unsigned int k = 0; k < 16; ++k) {
+            if (!(mask & (1u << k))) continue;
+            const sf::Uint8* p = line + (size_t)(x + k) * 4;
+            out[count++] = {sf::Color(p[0], p[1], p[2], p[3]), x + k, y};
+        }
+    }
+#endif
+    for (; x < width; ++x) {
+        const sf::Uint8* p = line + (size_t)x * 4;
+        if (p[3] == 0) continue;
+        if (out) out[count] = {sf::Color(p[0], p[1], p[2], p[3]), x, y};
+        ++count;
+    }
+    return count;
+}
+
+void opaqueTexels(const sf::Image& image, std::vector<TargetTexel>& out) {
+    unsigned int w = image.getSize().x, h = image.getSize().y;
+    const sf::Uint8* src = image.getPixelsPtr();
+    size_t stride = (size_t)w * 4;
+
+    size_t total = 0;
+    for (unsigned int y = 0; y < h; ++y) total += opaqueRow(src + y * stride, w, y, nullptr);
+
+    out.resize(total);
+    size_t next = 0;
+    for (unsigned int y = 0; y < h && next < total; ++y) next += opaqueRow(src + y * stride, w, y, out.data() + next);
+}
+
+void reduceGrid(const SampledImage& in, unsigned int factor, SampledImage& out) {
+    out.width = in.width;
+    out.height = in.height;
+    out.step = in.step * factor;
+    out.cols = (in.cols + factor - 1) / factor;
+    out.rows = (in.rows + factor - 1) / factor;
+    out.pixels.assign((size_t)out.cols * out.rows, sf::Color(0, 0, 0, 0));
+
+    for (unsigned int row = 0; row < out.rows; ++row) {
+        for (unsigned int col = 0; col < out.cols; ++col) {
+            std::uint64_t r = 0, g = 0, b = 0, a = 0, area = 0;
+            for (unsigned int y = row * factor; y < std::min(in.rows, (row + 1) * factor); ++y) {
+                for (unsigned int x = col * factor; x < std::min(in.cols, (col + 1) * factor); ++x) {
+                    const sf::Color& c = in.at(x, y);
+                    r += c.r * c.a;
+                    g += c.g * c.a;
+                    b += c.b * c.a;
+                    a += c.a;
+                    ++area;
+                }
+            }
+            if (a == 0) continue;
+
+            sf::Color c;
+            c.r = (sf::Uint8)((r + a / 2) / a);
+            c.g = (sf::Uint8)((g + a / 2) / a);
+            c.b = (sf::Uint8)((b + a / 2) / a);
+            c.a = (sf::Uint8)std::max<std::uint64_t>(1, (a + area / 2) / area);
+            out.pixels[(size_t)row * out.cols + col] = c;
+        }
+    }
+}
+
+unsigned int hilbertKey(const MatchColor& c, int bits) {
+    unsigned int X[3] = {(unsigned int)c.c[0], (unsigned int)c.c[1], (unsigned int)c.c[2]};
+    unsigned int top = 1u << (bits - 1);
+
+    for (unsigned int Q = top; Q > 1; Q >>= 1) {
+        unsigned int P = Q - 1;
+        for (int i = 0; i < 3; ++i) {
+            if (X[i] & Q) {
+                X[0] ^= P;
+            } else {
+                unsigned int t = (X[0] ^ X[i]) & P;
+                X[0] ^= t;
+                X[i] ^= t;
+            }
+        }
+    }
+
+    // gray encode
+    for (int i = 1; i < 3; ++i) X[i] ^= X[i - 1];
+    unsigned int t = 0;
+    for (unsigned int Q = top; Q > 1; Q >>= 1) {
+        if (X[2] & Q) t ^= Q - 1;
+    }
+    for (int i = 0; i < 3; ++i) X[i] ^= t;
+
+    // interleave the bits, msb first
+    unsigned int key = 0;
+    for (int b = bits - 1; b >= 0; --b) {
+        for (int i = 0; i < 3; ++i) {
+            key = (key << 1) | ((X[i] >> b) & 1u);
+        }
+    }
+    return key;
+}
+
+unsigned int hilbertKey(const sf::Color& c) {
+    return hilbertKey(toMatchColor(c, ColorSpace::Rgb), 8);
+}
+
+
+void buildQuadsScalar(const ParticleSystem& ps, float t, sf::Vector2f* out, size_t begin) {
+    for (size_t i = begin; i < ps.size(); ++i) {
+        float x = ps.xs[i] + ps.dxs[i] * t;
+        float y = ps.ys[i] + ps.dys[i] * t;
+        float s = ps.sizes[i];
+
+        sf::Vector2f* q = out + i * 4;
+        q[0] = sf::Vector2f(x, y);
+        q[1] = sf::Vector2f(x + s, y);
+        q[2] = sf::Vector2f(x + s, y + s);
+        q[3] = sf::Vector2f(x, y + s);
+    }
+}
+
+void buildQuadsScalar(const ParticleSystem& ps, float t, sf::Vector2f* out) {
+    buildQuadsScalar(ps, t, out, 0);
+}
+
+#ifdef TRUFFLIFY_AVX2
+// a holds 8 xs, b holds 8 ys, writes pair k into corner of particle k
+// out points at the corner of the first particle so particles are 4 corners apart
+__attribute__((target("avx2")))
+static inline void storeCorners8(__m256 a, __m256 b, sf::Vector2f* out) {
+    __m256 lo = _mm256_unpacklo_ps(a, b); // x0 y0 x1 y1 | x4 y4 x5 y5
+    __m256 hi = _mm256_unpackhi_ps(a, b); // x2 y2 x3 y3 | x6 y6 x7 y7
+    __m128 lo0 = _mm256_castps256_ps128(lo);
+    __m128 lo1 = _mm256_extractf128_ps(lo, 1);
+    __m128 hi0 = _mm256_castps256_ps128(hi);
+    __m128 hi1 = _mm256_extractf128_ps(hi, 1);
+
+    _mm_storel_pi((__m64*)&out[0], lo0);
+    _mm_storeh_pi((__m64*)&out[4], lo0);
+    _mm_storel_pi((__m64*)&out[8], hi0);
+    _mm_storeh_pi((__m64*)&out[12], hi0);
+    _mm_storel_pi((__m64*)&out[16], lo1);
+    _mm_storeh_pi((__m64*)&out[20], lo1);
+    _mm_storel_pi((__m64*)&out[24], hi1);
+    _mm_storeh_pi((__m64*)&out[28], hi1);
+}
+
+// 8 particles a go, mul + add instead of fma so it matches the scalar path exactly
+__attribute__((target("avx2")))
+void buildQuadsAvx2(const ParticleSystem& ps, float t, sf::Vector2f* out) {
+    size_t n = ps.size();
+    size_t i = 0;
+    __m256 vt = _mm256_set1_ps(t);
+
+    for (; i + 8 <= n; i += 8) {
+        __m256 x = _mm256_add_ps(_mm256_loadu_ps(&ps.xs[i]), _mm256_mul_ps(_mm256_loadu_ps(&ps.dxs[i]), vt));
+        __m256 y = _mm256_add_ps(_mm256_loadu_ps(&ps.ys[i]), _mm256_mul_ps(_mm256_loadu_ps(&ps.dys[i]), vt));
+        __m256 s = _mm256_loadu_ps(&ps.sizes[i]);
+        __m256 x2 = _mm256_add_ps(x, s);
+        __m256 y2 = _mm256_add_ps(y, s);
+
+        sf::Vector2f* q = out + i * 4;
+        storeCorners8(x, y, q);
+        storeCorners8(x2, y, q + 1);
+        storeCorners8(x2, y2, q + 2);
+        storeCorners8(x, y2, q + 3);
+    }
+
+    buildQuadsScalar(ps, t, out, i); // leftovers
+}
+#endif
+
+#ifdef TRUFFLIFY_NEON
+// same as above, a holds 4 xs and b 4 ys
+static inline void storeCorners4(float32x4_t a, float32x4_t b, sf::Vector2f* out) {
+    float32x4_t lo = vzip1q_f32(a, b); // x0 y0 x1 y1
+    float32x4_t hi = vzip2q_f32(a, b); // x2 y2 x3 y3
+
+    vst1_f32(&out[0].x, vget_low_f32(lo));
+    vst1_f32(&out[4].x, vget_high_f32(lo));
+    vst1_f32(&out[8].x, vget_low_f32(hi));
+    vst1_f32(&out[12].x, vget_high_f32(hi));
+}
+
+// neon registers are only 4 wide so this goes 4 at a time
+void buildQuadsNeon(const ParticleSystem& ps, float t, sf::Vector2f* out) {
+    size_t n = ps.size();
+    size_t i = 0;
+    float32x4_t vt = vdupq_n_f32(t);
+
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t x = vaddq_f32(vld1q_f32(&ps.xs[i]), vmulq_f32(vld1q_f32(&ps.dxs[i]), vt));
+        float32x4_t y = vaddq_f32(vld1q_f32(&ps.ys[i]), vmulq_f32(vld1q_f32(&ps.dys[i]), vt));
+        float32x4_t s = vld1q_f32(&ps.sizes[i]);
+        float32x4_t x2 = vaddq_f32(x, s);
+        float32x4_t y2 = vaddq_f32(y, s);
+
+        sf::Vector2f* q = out + i * 4;
+        storeCorners4(x, y, q);
+        storeCorners4(x2, y, q + 1);
+        storeCorners4(x2, y2, q + 2);
+        storeCorners4(x, y2, q + 3);
+    }
+
+    buildQuadsScalar(ps, t, out, i);
+}
+#endif
+
+QuadKernel pickQuadKernel() {
+#if defined(TRUFFLIFY_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return buildQuadsAvx2;
+#elif defined(TRUFFLIFY_NEON)
+    return buildQuadsNeon;
+#endif
+    return buildQuadsScalar;
+}
+
+// glsl side of Animation, gets glued in front of both vertex shaders
+const char* animationShaderCommon = R"(
+uniform float t;
+uniform float easeTable[65];
+uniform float randomDelay; // staggerAmount for Stagger::Random
+uniform vec2 sweep; // origin y + delay per pixel for Stagger::Sweep
+uniform float span;
+uniform float arc;
+
+float easeAt(float x) {
+    float f = clamp(x, 0.0, 1.0) * 64.0;
+    float i = min(floor(f), 63.0);
+    int j = int(i);
+    return mix(easeTable[j], easeTable[j + 1], f - i);
+}
+
+vec2 animate(vec2 start, vec2 trip, float startY, float key) {
+    float delay = randomDelay * key + sweep.y * max(startY - sweep.x, 0.0);
+    float eased = easeAt((t - delay) / span);
+    float bend = arc * (fract(key * 4096.0) * 2.0 - 1.0);
+    return start + trip * eased + vec2(-trip.y, trip.x) * (bend * 4.0 * eased * (1.0 - eased));
+}
+)";
+
+const char* particleVertexShader = R"(
+void main() {
+    // sweep off the particle's start y, not the corner's, so all 4 corners move together like the cpu path
+    vec2 pos = animate(gl_Vertex.xy, gl_MultiTexCoord0.xy, gl_MultiTexCoord0.z, gl_MultiTexCoord0.w);
+    gl_Position = gl_ModelViewProjectionMatrix * vec4(pos, 0.0, 1.0);
+    gl_FrontColor = gl_Color;
+}
+)";
+
+const char* particleFragmentShader = R"(
+void main() {
+    gl_FragColor = gl_Color;
+}
+)";
+
+bool GlBufferFunctions::load() {
+    genBuffers = (GenBuffersFn)sf::Context::getFunction("glGenBuffers");
+    deleteBuffers = (DeleteBuffersFn)sf::Context::getFunction("glDeleteBuffers");
+    bindBuffer = (BindBufferFn)sf::Context::getFunction("glBindBuffer");
+    bufferData = (BufferDataFn)sf::Context::getFunction("glBufferData");
+    mapBuffer = (MapBufferFn)sf::Context::getFunction("glMapBuffer");
+    unmapBuffer = (UnmapBufferFn)sf::Context::getFunction("glUnmapBuffer");
+    return genBuffers && deleteBuffers && bindBuffer && bufferData && mapBuffer && unmapBuffer;
+}
+
+const char* pointVertexShader = R"(
+uniform float pixelScale;
+
+void main() {
+    float size = gl_MultiTexCoord0.z;
+
+    // quads were drawn from their top left corner, sprites are centred
+    vec2 pos = animate(gl_Vertex.xy, gl_MultiTexCoord0.xy, gl_Vertex.y, gl_MultiTexCoord0.w) + vec2(size * 0.5);
+    gl_Position = gl_ModelViewProjectionMatrix * vec4(pos, 0.0, 1.0);
+    gl_PointSize = size * pixelScale;
+    gl_FrontColor = gl_Color;
+}
+)";
+
+bool GpuRenderer::init() {
+    if (ready) return true;
+
+    if (!gl.load()) return false;
+
+    const char* vertexShader = points ? pointVertexShader : particleVertexShader;
+    if (!sf::Shader::isAvailable() || !shader.loadFromMemory(std::string(animationShaderCommon) + vertexShader, particleFragmentShader)) return false;
+
+    gl.genBuffers(1, &buffer);
+    ready = buffer != 0;
+    return ready;
+}
+
+void GpuRenderer::upload(const ParticleSystem& ps, const Animation& anim) {
+    size_t corners = points ? 1 : 4;
+    std::vector<GpuVertex> vertices(ps.size() * corners);
+    for (size_t i = 0; i < ps.size(); ++i) {
+        float x = ps.xs[i], y = ps.ys[i], s = ps.sizes[i];
+        GpuVertex v = {x, y, ps.dxs[i], ps.dys[i], s, anim.key(i), ps.colors[i]};
+        if (!points) v.startY = y;
+        GpuVertex* q = &vertices[i * corners];
+        q[0] = v;
+        if (points) continue;
+
+        // quads get their corners baked in, same order buildQuadsScalar writes them
+        q[1] = v;
+        q[1].x = x + s;
+        q[2] = v;
+        q[2].x = x + s;
+        q[2].y = y + s;
+        q[3] = v;
+        q[3].y = y + s;
+    }
+    vertexCount = vertices.size();
+
+    gl.bindBuffer(GL_ARRAY_BUFFER, buffer);
+    gl.bufferData(GL_ARRAY_BUFFER, (std::ptrdiff_t)(vertices.size() * sizeof(GpuVertex)), vertices.data(), GL_STATIC_DRAW);
+    gl.bindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// take over the context, same projection + viewport + blending sfml would use for its own draws
+static sf::IntRect beginRawDraw(sf::RenderTarget& target) {
+    target.setActive(true);
+    const sf::View& view = target.getView();
+    sf::IntRect viewport = target.getViewport(view);
+    glViewport(viewport.left, (GLint)target.getSize().y - (viewport.top + viewport.height), viewport.width, viewport.height);
+    glMatrixMode(GL_PROJECTION);
+    glLoadMatrixf(view.getTransform().getMatrix());
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    return viewport;
+}
+
+void GpuRenderer::draw(sf::RenderTarget& target) {
+    if (vertexCount == 0) return;
+
+    const sf::View& view = target.getView();
+    sf::IntRect viewport = beginRawDraw(target);
+    if (points) {
+        glEnable(GL_VERTEX_PROGRAM_POINT_SIZE);
+        shader.setUniform("pixelScale", viewport.height / view.getSize().y);
+    }
+    sf::Shader::bind(&shader);
+
+    gl.bindBuffer(GL_ARRAY_BUFFER, buffer);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(2, GL_FLOAT, sizeof(GpuVertex), (const void*)offsetof(GpuVertex, x));
+    glTexCoordPointer(4, GL_FLOAT, sizeof(GpuVertex), (const void*)offsetof(GpuVertex, dx));
+    glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(GpuVertex), (const void*)offsetof(GpuVertex, color));
+
+    glDrawArrays(points ? GL_POINTS : GL_QUADS, 0, (GLsizei)vertexCount);
+
+    gl.bindBuffer(GL_ARRAY_BUFFER, 0);
+    if (points) glDisable(GL_VERTEX_PROGRAM_POINT_SIZE);
+    sf::Shader::bind(nullptr);
+
+    // hand the context back to sfml in a state it knows about
+    target.resetGLStates();
+}
+
+bool QuadStreamRenderer::init() {
+    if (ready) return true;
+
+    if (!gl.load()) return false;
+
+    gl.genBuffers(2, buffers);
+    ready = buffers[0] != 0 && buffers[1] != 0;
+    return ready;
+}
+
+void QuadStreamRenderer::upload(const ParticleSystem& ps) {
+    std::vector<sf::Color> colors(ps.size() * 4);
+    for (size_t i = 0; i < ps.size(); ++i) {
+        for (size_t k = 0; k < 4; ++k) colors[i * 4 + k] = ps.colors[i];
+    }
+    quadCount = ps.size();
+
+    gl.bindBuffer(GL_ARRAY_BUFFER, buffers[1]);
+    gl.bufferData(GL_ARRAY_BUFFER, (std::ptrdiff_t)(colors.size() * sizeof(sf::Color)), colors.data(), GL_STATIC_DRAW);
+    gl.bindBuffer(GL_ARRAY_BUFFER, buffers[0]);
+    gl.bufferData(GL_ARRAY_BUFFER, (std::ptrdiff_t)(quadCount * 4 * sizeof(sf::Vector2f)), nullptr, GL_STREAM_DRAW);
+    gl.bindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+sf::Vector2f* QuadStreamRenderer::map() {
+    if (quadCount == 0) return nullptr;
+
+    // orphaning first means the driver hands over fresh memory instead of waiting on the last frame
+    gl.bindBuffer(GL_ARRAY_BUFFER, buffers[0]);
+    gl.bufferData(GL_ARRAY_BUFFER, (std::ptrdiff_t)(quadCount * 4 * sizeof(sf::Vector2f)), nullptr, GL_STREAM_DRAW);
+    sf::Vector2f* out = (sf::Vector2f*)gl.mapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
+    if (!out) gl.bindBuffer(GL_ARRAY_BUFFER, 0);
+    return out;
+}
+
+void QuadStreamRenderer::unmap() {
+    gl.unmapBuffer(GL_ARRAY_BUFFER);
+    gl.bindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void QuadStreamRenderer::write(const sf::Vector2f* corners) {
+    gl.bindBuffer(GL_ARRAY_BUFFER, buffers[0]);
+    gl.bufferData(GL_ARRAY_BUFFER, (std::ptrdiff_t)(quadCount * 4 * sizeof(sf::Vector2f)), corners, GL_STREAM_DRAW);
+    gl.bindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void QuadStreamRenderer::draw(sf::RenderTarget& target) {
+    if (quadCount == 0) return;
+
+    beginRawDraw(target);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    gl.bindBuffer(GL_ARRAY_BUFFER, buffers[0]);
+    glVertexPointer(2, GL_FLOAT, sizeof(sf::Vector2f), nullptr);
+    gl.bindBuffer(GL_ARRAY_BUFFER, buffers[1]);
+    glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(sf::Color), nullptr);
+
+    glDrawArrays(GL_QUADS, 0, (GLsizei)(quadCount * 4));
+
+    gl.bindBuffer(GL_ARRAY_BUFFER, 0);
+    target.resetGLStates();
+}
+
+// target cache, sits next to the target as <target>.idx
+// holds the opaque texel list + colour index so repeat runs skip the decode and the tree build
+// keyed by the hash of the target file, screen positions are worked out per window from the texels
+const char targetCacheMagic[8] = {'T', 'R', 'U', 'F', 'I', 'D', 'X', '2'};
+
+struct TargetCacheHeader {
+    char magic[8];
+    std::uint64_t fileHash;
+    std::uint32_t width, height;
+    std::uint32_t colorSpace; // the index is built in one space, a different one means rebuild
+    std::uint32_t reserved;
+};
+
+bool readTargetCache(const std::string& path, std::uint64_t fileHash, ColorSpace space, sf::Vector2u& size,
+                     std::vector<TargetTexel>& texels, ColorIndex& index) {
+    MappedFile file;
+    if (!file.open(path) || file.size() < sizeof(TargetCacheHeader)) return false;
+
+    TargetCacheHeader header;
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (std::memcmp(header.magic, targetCacheMagic, sizeof(targetCacheMagic)) != 0 || header.fileHash != fileHash) return false;
+    if (header.colorSpace != (std::uint32_t)space) return false;
+
+    const char* p = file.data() + sizeof(header);
+    const char* end = file.data() + file.size();
+    // anything off falls through to a fresh decode + rebuild in Target::load
+    if (!readArray(p, end, texels) || !index.load(p, end, space, texels.size())) return false;
+
+    size = sf::Vector2u(header.width, header.height);
+    return true;
+}
+
+// best effort, a read only folder just means no cache
+void writeTargetCache(const std::string& path, std::uint64_t fileHash, sf::Vector2u size,
+                      const std::vector<TargetTexel>& texels, const ColorIndex& index) {
+    TargetCacheHeader header;
+    std::memcpy(header.magic, targetCacheMagic, sizeof(targetCacheMagic));
+    header.fileHash = fileHash;
+    header.width = size.x;
+    header.height = size.y;
+    header.colorSpace = (std::uint32_t)index.colorSpace();
+    header.reserved = 0;
+
+    std::vector<char> out((const char*)&header, (const char*)&header + sizeof(header));
+    writeArray(out, texels);
+    index.save(out);
+
+    // write to a temp file first so a half written cache never gets mapped
+    std::string tmpPath = path + ".tmp";
+    {
+        std::ofstream f(tmpPath, std::ios::binary | std::ios::trunc);
+        if (!f.write(out.data(), (std::streamsize)out.size())) return;
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmpPath, path, ec);
+    if (ec) std::filesystem::remove(tmpPath, ec);
+}
+
+float easeOutCubic(float x) {
+    float k = 1.0f - x;
+    return 1.0f - k * k * k;
+}
+
+static float fract(float x) {
+    return x - std::floor(x);
+}
+
+// xor'd into the seed so the keys are their own stream, a new RandomDraw would shift every layout
+const std::uint64_t animationSeedSalt = 0x6A09E667F3BCC909ULL;
+
+float Animation::key(size_t id) const {
+    return randomFloat(seed ^ animationSeedSalt, id, DrawSize, 0.0f, 1.0f);
+}
+
+// x(s) of a css cubic-bezier is monotonic for x1, x2 in 0..1 so bisection always finds s
+static float cubicBezierAt(const float b[4], float x) {
+    float x1 = std::min(std::max(b[0], 0.0f), 1.0f), x2 = std::min(std::max(b[2], 0.0f), 1.0f);
+    float lo = 0.0f, hi = 1.0f, s = x;
+    for (int i = 0; i < 32; ++i) {
+        s = (lo + hi) * 0.5f;
+        float k = 1.0f - s;
+        float bx = 3.0f * k * k * s * x1 + 3.0f * k * s * s * x2 + s * s * s;
+        if (bx < x) lo = s; else hi = s;
+    }
+    float k = 1.0f - s;
+    return 3.0f * k * k * s * b[1] + 3.0f * k * s * s * b[3] + s * s * s;
+}
+
+void Animation::setStyle(const AnimationStyle& s) {
+    style = s;
+    style.staggerAmount = std::min(std::max(style.staggerAmount, 0.0f), 0.95f);
+    setSweep(sweepOrigin, sweepHeight);
+
+    // the shaders always go through the table, the cpu only needs it for bezier
+    if (style.easing == Easing::Bezier) {
+        for (int i = 0; i < tableSize; ++i) table[i] = cubicBezierAt(style.bezier, (float)i / (tableSize - 1));
+    } else {
+        for (int i = 0; i < tableSize; ++i) table[i] = ease((float)i / (tableSize - 1));
+    }
+}
+
+void Animation::setSweep(float top, float height) {
+    sweepOrigin = top;
+    sweepHeight = height;
+    sweepScale = style.stagger == Stagger::Sweep && height > 0.0f ? style.staggerAmount / height : 0.0f;
+}
+
+float Animation::ease(float x) const {
+    x = std::min(std::max(x, 0.0f), 1.0f);
+    switch (style.easing) {
+        case Easing::Linear:
+            return x;
+        case Easing::InOutCubic: {
+            if (x < 0.5f) return 4.0f * x * x * x;
+            float k = 1.0f - x;
+            return 1.0f - 4.0f * k * k * k;
+        }
+        case Easing::OutBack: {
+            const float c1 = 1.70158f, c3 = c1 + 1.0f;
+            float k = x - 1.0f;
+            return 1.0f + c3 * k * k * k + c1 * k * k;
+        }
+        case Easing::Bezier: {
+            float f = x * (tableSize - 1);
+            int i = std::min((int)f, tableSize - 2);
+            return table[i] + (table[i + 1] - table[i]) * (f - i);
+        }
+        default:
+            return easeOutCubic(x);
+    }
+}
+
+float Animation::delay(float startY, float key) const {
+    float d = sweepScale * std::max(startY - sweepOrigin, 0.0f);
+    if (style.stagger == Stagger::Random) d += style.staggerAmount * key;
+    return d;
+}
+
+float Animation::bend(float key) const {
+    return style.arc * (fract(key * 4096.0f) * 2.0f - 1.0f);
+}
+
+void Animation::plan(ParticleSystem& ps) const {
+    if (!perParticle()) {
+        ps.delays.clear(); ps.bends.clear();
+        return;
+    }
+    ps.delays.resize(ps.size());
+    ps.bends.resize(ps.size());
+    for (size_t i = 0; i < ps.size(); ++i) {
+        float k = key(i);
+        ps.delays[i] = delay(ps.ys[i], k);
+        ps.bends[i] = bend(k);
+    }
+}
+
+void Animation::applyUniforms(sf::Shader& shader) const {
+    shader.setUniformArray("easeTable", table, tableSize);
+    shader.setUniform("randomDelay", style.stagger == Stagger::Random ? style.staggerAmount : 0.0f);
+    shader.setUniform("sweep", sf::Vector2f(sweepOrigin, sweepScale));
+    shader.setUniform("span", span());
+    shader.setUniform("arc", style.arc);
+}
+
+void buildQuadsAnimated(const ParticleSystem& ps, const Animation& anim, float t, sf::Vector2f* out) {
+    const float invSpan = 1.0f / anim.span();
+    for (size_t i = 0; i < ps.size(); ++i) {
+        float eased = anim.ease((t - ps.delays[i]) * invSpan);
+        float curve = ps.bends[i] * 4.0f * eased * (1.0f - eased);
+        float x = ps.xs[i] + ps.dxs[i] * eased - ps.dys[i] * curve;
+        float y = ps.ys[i] + ps.dys[i] * eased + ps.dxs[i] * curve;
+        float s = ps.sizes[i];
+
+        sf::Vector2f* q = out + i * 4;
+        q[0] = sf::Vector2f(x, y);
+        q[1] = sf::Vector2f(x + s, y);
+        q[2] = sf::Vector2f(x + s, y + s);
+        q[3] = sf::Vector2f(x, y + s);
+    }
+}
+
+bool Trufflifier::loadInput(const std::string& inputPath) {
+    cancelInit();
+    ScopedTimer timer(initTimes.loadInputMs);
+
+    // fixed per input so budget changes dont reshuffle everything
+    seed = fixedSeed >= 0 ? (std::uint64_t)fixedSeed : std::random_device{}(); // this is disgusting
+    inputHash = 0;
+    pendingInput.clear();
+
+    sf::Image inputImage;
+    bool ok;
+    if (resultCache) {
+        // raw bytes first, hashing those is way cheaper than a decode
+        std::vector<char> bytes;
+        std::ifstream f(inputPath, std::ios::binary);
+        if (f) bytes.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+        inputHash = hashBytes(bytes.data(), bytes.size());
+
+        // seen this one before, the decode can wait until a layout actually misses
+        if (!bytes.empty() && resultCache->hasInput(inputHash)) {
+            pendingInput = std::move(bytes);
+            sourceGrid = SampledImage();
+            input = SampledImage();
+            gridFactor = 1;
+            return true;
+        }
+        ok = !bytes.empty() && inputImage.loadFromMemory(bytes.data(), bytes.size());
+    } else {
+        ok = inputImage.loadFromFile(inputPath);
+    }
+
+    if (!ok) {
+        std::cerr << "Failed to load input: " << inputPath << std::endl;
+        return false;
+    }
+
+    // the decode gets dropped on return
+    sampleInput(inputImage);
+    return true;
+}
+
+bool Trufflifier::loadInput(const sf::Image& inputImage) {
+    cancelInit();
+    ScopedTimer timer(initTimes.loadInputMs);
+
+    seed = fixedSeed >= 0 ? (std::uint64_t)fixedSeed : std::random_device{}();
+    inputHash = 0;
+    if (resultCache) {
+        const sf::Vector2u& size = inputImage.getSize();
+        inputHash = hashBytes(&size, sizeof(size));
+        if (inputImage.getPixelsPtr()) inputHash = hashBytes(inputImage.getPixelsPtr(), (size_t)size.x * size.y * 4, inputHash);
+    }
+    pendingInput.clear();
+
+    sampleInput(inputImage);
+    return true;
+}
+
+void Trufflifier::sampleInput(const sf::Image& inputImage) {
+    // boil it down to one averaged colour per particle
+    unsigned int step = sampleStep(inputImage.getSize().x, inputImage.getSize().y, maxParticles);
+    downsampleImage(inputImage, step, threadCount, sourceGrid);
+    input = sourceGrid;
+    gridFactor = 1;
+}
+
+bool Trufflifier::ensureInput() {
+    if (pendingInput.empty()) return true;
+    ScopedTimer timer(initTimes.loadInputMs);
+
+    sf::Image inputImage;
+    bool ok = inputImage.loadFromMemory(pendingInput.data(), pendingInput.size());
+    pendingInput.clear();
+    if (!ok) {
+        std::cerr << "Failed to decode input." << std::endl;
+        return false;
+    }
+    sampleInput(inputImage);
+    return true;
+}
+
+bool Trufflifier::setParticleBudget(float budget) {
+    cancelInit(); // the init thread reads input
+    ensureInput();
+    if (sourceGrid.pixels.empty()) return false;
+
+    float full = (float)sourceGrid.pixels.size();
+    unsigned int factor = 1;
+    if (budget < maxParticles && budget < full) factor = (unsigned int)std::ceil(std::sqrt(full / std::max(1.0f, budget)));
+    if (factor == gridFactor) return false;
+
+    gridFactor = factor;
+    if (factor == 1) {
+        input = sourceGrid;
+    } else {
+        reduceGrid(sourceGrid, factor, input);
+    }
+    return true;
+}
+
+bool Target::load(const std::string& targetPath, ColorSpace space, bool useCache) {
+    ScopedTimer timer(loadMs);
+    path = targetPath;
+
+    // raw bytes first, the hash decides whether we even need to decode
+    std::vector<char> bytes;
+    std::ifstream f(targetPath, std::ios::binary);
+    if (f) bytes.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+
+    // try to load truffle, fallback if not found
+    if (bytes.empty()) {
+        std::cout << "Failed to load target (" << targetPath << "). Make sure it is in the same directory." << std::endl;
+        return false;
+    }
+
+    hash = hashBytes(bytes.data(), bytes.size());
+
+    std::string cachePath = targetPath + (space == ColorSpace::OkLab ? ".oklab.idx" : ".idx");
+    if (useCache && readTargetCache(cachePath, hash, space, size, texels, index)) {
+        palette.build(index);
+        return true;
+    }
+
+    sf::Image targetImage;
+    if (!targetImage.loadFromMemory(bytes.data(), bytes.size())) {
+        std::cout << "Failed to load target (" << targetPath << "). Make sure it is in the same directory." << std::endl;
+        return false;
+    }
+
+    // keep the opaque pixels only
+    size = targetImage.getSize();
+    opaqueTexels(targetImage, texels);
+
+    // build the colour index once, every particle queries it
+    index.build(texels, space);
+    palette.build(index);
+
+    if (useCache) writeTargetCache(cachePath, hash, size, texels, index);
+    return true;
+}
+
+bool TargetLibrary::load(const std::vector<std::string>& paths, ColorSpace space, bool useCache, unsigned int threads) {
+    std::vector<std::shared_ptr<Target>> loaded(paths.size());
+    parallelFor((unsigned int)paths.size(), threads, [&](unsigned int i) {
+        std::shared_ptr<Target> target = std::make_shared<Target>();
+        if (target->load(paths[i], space, useCache)) loaded[i] = target;
+    });
+
+    // a broken one just gets left out, order stays the same as the command line
+    targets.clear();
+    for (const auto& target : loaded) {
+        if (target) targets.push_back(target);
+    }
+    return !targets.empty();
+}
+
+bool Trufflifier::loadTarget(const std::string& targetPath) {
+    std::shared_ptr<Target> loaded = std::make_shared<Target>();
+    if (!loaded->load(targetPath, colorSpace, useTargetCache)) return false;
+    setTarget(loaded);
+    return true;
+}
+
+void Trufflifier::setTarget(std::shared_ptr<const Target> next) {
+    cancelInit(); // the init thread reads the target
+    target = std::move(next);
+    initTimes.loadTargetMs = target ? target->loadMs : 0.0;
+    targetDirty = true;
+}
+
+// first j in [begin, end) where swapping the slots of i and j lowers the total diff, end if none
+// p is the particle colours in sorted order, s the colour of the slot each one has, cur = diff(p, s)
+static size_t firstBetterSwap(const PackedColors& p, const PackedColors& s, const std::vector<float>& cur,
+                              size_t i, size_t begin, size_t end) {
+    size_t j = begin;
+#ifdef TRUFFLIFY_SSE2
+    // 4 candidates a go, lanes past end get masked off
+    __m128 pi[3], si[3];
+    for (int k = 0; k < 3; ++k) {
+        pi[k] = _mm_set1_ps(p.c[k][i]);
+        si[k] = _mm_set1_ps(s.c[k][i]);
+    }
+    __m128 curI = _mm_set1_ps(cur[i]);
+
+    for (; j < end; j += 4) {
+        __m128 after = _mm_setzero_ps();
+        for (int k = 0; k < 3; ++k) {
+            __m128 a = _mm_sub_ps(pi[k], _mm_loadu_ps(&s.c[k][j])); // p_i in slot j
+            __m128 b = _mm_sub_ps(_mm_loadu_ps(&p.c[k][j]), si[k]); // p_j in slot i
+            after = _mm_add_ps(after, _mm_add_ps(_mm_mul_ps(a, a), _mm_mul_ps(b, b)));
+        }
+        __m128 before = _mm_add_ps(curI, _mm_loadu_ps(&cur[j]));
+
+        int mask = _mm_movemask_ps(_mm_cmplt_ps(after, before));
+        mask &= (1 << std::min<size_t>(4, end - j)) - 1;
+        for (int k = 0; k < 4; ++k) {
+            if (mask & (1 << k)) return j + k;
+        }
+    }
+#else
+    for (; j < end; ++j) {
+        if (p.diff(i, s, j) + p.diff(j, s, i) < cur[i] + cur[j]) return j;
+    }
+#endif
+    return end;
+}
+
+void Trufflifier::matchUnique(ParticleSystem& ps, const std::vector<TargetPixel>& targetPixels, float targetScale, UniqueScratch& scratch) const {
+    size_t n = ps.size();
+    size_t t = targetPixels.size();
+    if (n == 0 || t == 0) return;
+
+    int sub = (int)std::ceil(std::sqrt((double)n / t));
+    size_t slots = t * sub * sub;
+
+    // both sides converted once, nothing below touches an sf::Color again
+    int bits = matchColorBits(colorSpace);
+    std::vector<MatchColor>& colors = scratch.colors;
+    std::vector<int>& order = scratch.order;
+    std::vector<unsigned int>& keys = scratch.keys;
+    colors.resize(n);
+    order.resize(n);
+    keys.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        colors[i] = toMatchColor(ps.colors[i], colorSpace);
+        order[i] = (int)i;
+        keys[i] = hilbertKey(colors[i], bits);
+    }
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+        return keys[a] != keys[b] ? keys[a] < keys[b] : a < b;
+    });
+
+    std::vector<MatchColor>& targetColors = scratch.targetColors;
+    std::vector<int>& targetOrder = scratch.targetOrder;
+    std::vector<unsigned int>& targetKeys = scratch.targetKeys;
+    targetColors.resize(t);
+    targetOrder.resize(t);
+    targetKeys.resize(t);
+    for (size_t i = 0; i < t; ++i) {
+        targetColors[i] = toMatchColor(targetPixels[i].color, colorSpace);
+        targetOrder[i] = (int)i;
+        targetKeys[i] = hilbertKey(targetColors[i], bits);
+    }
+    std::sort(targetOrder.begin(), targetOrder.end(), [&](int a, int b) {
+        return targetKeys[a] != targetKeys[b] ? targetKeys[a] < targetKeys[b] : a < b;
+    });
+
+    // spread ranks evenly over the slots so coverage is even when slots > particles
+    std::vector<size_t>& slotOf = scratch.slotOf;
+    slotOf.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        slotOf[i] = (size_t)(((double)i + 0.5) * slots / n);
+    }
+
+    // sorted particle colours, the colour of the slot each one is in, and the diff between the two
+    PackedColors& packed = scratch.packed;
+    PackedColors& slotColors = scratch.slotColors;
+    std::vector<float>& cur = scratch.cur;
+    packed.resize(n);
+    slotColors.resize(n);
+    cur.assign(n + 4, 0.0f);
+    for (size_t i = 0; i < n; ++i) {
+        packed.set(i, colors[order[i]]);
+        slotColors.set(i, targetColors[targetOrder[slotOf[i] / (sub * sub)]]);
+        cur[i] = packed.diff(i, slotColors, i);
+    }
+
+    // neighbour swaps along the sorted order, only keep the ones that lower the total diff
+    // a swap changes slot i, so the search picks up again right after it
+    const size_t window = 8;
+    for (int pass = 0; pass < 3; ++pass) {
+        bool changed = false;
+        for (size_t i = 0; i < n; ++i) {
+            size_t end = std::min(n, i + 1 + window);
+            for (size_t j = firstBetterSwap(packed, slotColors, cur, i, i + 1, end); j < end;
+                 j = firstBetterSwap(packed, slotColors, cur, i, j + 1, end)) {
+                std::swap(slotOf[i], slotOf[j]);
+                slotColors.swap(i, j);
+                cur[i] = packed.diff(i, slotColors, i);
+                cur[j] = packed.diff(j, slotColors, j);
+                changed = true;
+            }
+        }
+        if (!changed) break;
+    }
+
+    // jitter stays inside the slot so they dont pile up again
+    float slotSize = targetScale / sub;
+    float jitter = slotSize * 0.4f;
+
+    for (size_t i = 0; i < n; ++i) {
+        size_t slot = slotOf[i];
+        const TargetPixel& tp = targetPixels[targetOrder[slot / (sub * sub)]];
+        int cell = (int)(slot % (sub * sub));
+
+        sf::Vector2f endPos = tp.pos;
+        endPos.x += (cell % sub) * slotSize + randomFloat(seed, order[i], DrawJitterX, -jitter, jitter);
+        endPos.y += (cell / sub) * slotSize + randomFloat(seed, order[i], DrawJitterY, -jitter, jitter);
+        ps.setEnd(order[i], endPos);
+    }
+}
+
+void Trufflifier::prepareTarget(unsigned int windowW, unsigned int windowH) {
+    if (!targetDirty && windowW == preparedW && windowH == preparedH) return;
+    ScopedTimer timer(initTimes.targetScanMs);
+
+    preparedW = windowW;
+    preparedH = windowH;
+    targetDirty = false;
+    if (!target) {
+        targetPixels.clear();
+        return;
+    }
+    const sf::Vector2u& targetSize = target->size;
+    const std::vector<TargetTexel>& targetTexels = target->texels;
+
+    float targetAspect = (float)targetSize.x / targetSize.y;
+    float windowAspect = (float)windowW / windowH;
+
+    if (targetAspect > windowAspect) {
+        targetScale = (windowW * 0.8f) / targetSize.x;
+    } else {
+        targetScale = (windowH * 0.8f) / targetSize.y;
+    }
+    targetScale = std::max(1.0f, targetScale);
+
+    targetOffset.x = (windowW - targetSize.x * targetScale) / 2.0f;
+    targetOffset.y = (windowH - targetSize.y * targetScale) / 2.0f;
+
+    // pre-calculate target spots so we can find them fast
+    // list of {color, pos} basically, same order as the texels so the index still lines up
+    targetPixels.resize(targetTexels.size());
+    for (size_t i = 0; i < targetTexels.size(); ++i) {
+        const TargetTexel& tx = targetTexels[i];
+        targetPixels[i] = {tx.color, sf::Vector2f(targetOffset.x + tx.x * targetScale, targetOffset.y + tx.y * targetScale)};
+    }
+}
+
+void Trufflifier::placeInput(unsigned int windowW, unsigned int windowH) {
+    // calculate display size so the input fits
+    float displayScaleX = (float)windowW / input.width;
+    float displayScaleY = (float)windowH / input.height;
+    displayScale = std::min(displayScaleX, displayScaleY) * 0.8f; // 80% of window cause margins are nice
+
+    inputOffset.x = (windowW - input.width * displayScale) / 2.0f;
+    inputOffset.y = (windowH - input.height * displayScale) / 2.0f;
+
+    // make particles fatter if we skipped pixels
+    baseParticleSize = std::max(1.0f, displayScale * input.step);
+}
+
+void Trufflifier::initParticles(unsigned int windowW, unsigned int windowH) {
+    matchParticles(windowW, windowH);
+    initVertices();
+}
+
+void Trufflifier::matchParticles(unsigned int windowW, unsigned int windowH) {
+    cancelInit();
+    prepareTarget(windowW, windowH);
+    if (restoreLayout(windowW, windowH)) return;
+    ensureInput();
+
+    Stopwatch matchWatch;
+
+    // 2. where do they start?
+    // loadInput already downsampled to ~maxParticles (or less, see setParticleBudget)
+    placeInput(windowW, windowH);
+
+    particles.resize(countParticles());
+    matchBands(particles, nullptr, nullptr);
+    finishMatch(particles, uniqueScratch);
+    sortParticles(particles, orderScratch);
+    applyOrder(particles, orderScratch);
+    initTimes.matchMs = matchWatch.ms();
+    storeLayout();
+}
+
+ParticleLayout Trufflifier::takeLayout() {
+    cancelInit();
+    ParticleLayout layout;
+    std::swap(layout.particles, particles);
+    layout.width = input.width;
+    layout.height = input.height;
+    layout.step = input.step;
+    layout.seed = seed;
+    vertexArray.clear();
+    return layout;
+}
+
+void Trufflifier::setLayout(ParticleLayout&& layout, unsigned int windowW, unsigned int windowH) {
+    cancelInit();
+    input.width = layout.width;
+    input.height = layout.height;
+    input.step = layout.step;
+    seed = layout.seed;
+    placeInput(windowW, windowH);
+    std::swap(particles, layout.particles); // the old buffers go back with the layout, reusable
+    initTimes.matchMs = 0.0;
+    initVertices();
+}
+
+unsigned int Trufflifier::getBandCount() const {
+    return (input.rows + rowsPerBand - 1) / rowsPerBand;
+}
+
+size_t Trufflifier::countParticles() {
+    unsigned int bands = getBandCount();
+    bandStart.assign(bands + 1, 0);
+    for (unsigned int row = 0; row < input.rows; ++row) {
+        size_t opaque = 0;
+        for (unsigned int col = 0; col < input.cols; ++col) {
+            if (input.at(col, row).a != 0) ++opaque;
+        }
+        bandStart[row / rowsPerBand + 1] += opaque;
+    }
+    for (unsigned int b = 0; b < bands; ++b) bandStart[b + 1] += bandStart[b];
+    return bandStart[bands];
+}
+
+void Trufflifier::matchBands(ParticleSystem& out, std::atomic<bool>* bandDone, const std::atomic<bool>* cancel) const {
+    unsigned int step = input.step;
+
+    // every draw is keyed off the input cell it came from (see randomBits),
+    // so the layout doesnt change with the thread count, the band size or running in the background
+    float jitter = targetScale * 0.4f; // make it messy
+    bool coarse = coarseMatch && !uniqueMatch && target && !target->palette.empty();
+    ColorSpace space = target ? target->index.colorSpace() : ColorSpace::Rgb;
+    parallelFor((unsigned int)bandStart.size() - 1, threadCount, [&](unsigned int band) {
+        if (cancel && *cancel) return;
+
+        size_t next = bandStart[band];
+
+        unsigned int rowBegin = band * rowsPerBand;
+        unsigned int rowEnd = std::min(input.rows, rowBegin + rowsPerBand);
+        std::vector<int> blockCluster;
+
+        for (unsigned int row = rowBegin; row < rowEnd; ++row) {
+            // coarse mode picks the cluster once per 2x2 block (off the block average), the cells
+            // inside only search that cluster. bands are an even number of rows so blocks never
+            // straddle two of them
+            if (coarse && (row - rowBegin) % 2 == 0) blockClusters(row, blockCluster);
+
+            for (unsigned int col = 0; col < input.cols; ++col) {
+                const sf::Color& inputCol = input.at(col, row);
+                float x = (float)(col * step);
+                float y = (float)(row * step);
+
+                // invisible pixels are skipped
+                if(inputCol.a == 0) continue;
+
+                sf::Vector2f startPos(inputOffset.x + x * displayScale, inputOffset.y + y * displayScale);
+                sf::Vector2f endPos = startPos;
+                size_t id = next++;
+                float size = baseParticleSize * randomFloat(seed, id, DrawSize, 0.8f, 1.2f); // random fat
+
+                // find best match in target
+                if (targetPixels.empty() || uniqueMatch) {
+                    // stay put, unique mode places them all at once in finishMatch
+                } else {
+                    // exact closest colour from the index, if a bunch of target pixels
+                    // share it just pick one at random so they still spread out
+                    int group = coarse ? target->palette.nearestInCluster(blockCluster[col / 2], toMatchColor(inputCol, space))
+                                       : target->index.nearest(inputCol);
+                    unsigned int pick = randomIndex(seed, id, DrawMember, (unsigned int)target->index.groupSize(group));
+                    int bestIndex = target->index.member(group, (int)pick);
+
+                    // jitter the end pos so it doesnt look like a boring grid
+                    endPos = targetPixels[bestIndex].pos;
+                    endPos.x += randomFloat(seed, id, DrawJitterX, -jitter, jitter);
+                    endPos.y += randomFloat(seed, id, DrawJitterY, -jitter, jitter);
+                }
+
+                out.set(id, startPos, endPos, size, inputCol);
+            }
+        }
+
+        if (bandDone) bandDone[band] = true;
+    });
+}
+
+void Trufflifier::blockClusters(unsigned int row, std::vector<int>& out) const {
+    const ColorPalette& palette = target->palette;
+    ColorSpace space = target->index.colorSpace();
+    unsigned int rowEnd = std::min(input.rows, row + 2);
+    out.assign((input.cols + 1) / 2, 0);
+    for (unsigned int block = 0; block < out.size(); ++block) {
+        unsigned int colEnd = std::min(input.cols, block * 2 + 2);
+        unsigned int sum[3] = {0, 0, 0};
+        unsigned int count = 0;
+        for (unsigned int y = row; y < rowEnd; ++y) {
+            for (unsigned int x = block * 2; x < colEnd; ++x) {
+                const sf::Color& c = input.at(x, y);
+                if (c.a == 0) continue;
+                sum[0] += c.r;
+                sum[1] += c.g;
+                sum[2] += c.b;
+                ++count;
+            }
+        }
+        if (count == 0) continue; // nothing in here gets matched anyway
+
+        sf::Color average((sf::Uint8)(sum[0] / count), (sf::Uint8)(sum[1] / count), (sf::Uint8)(sum[2] / count));
+        out[block] = palette.nearestCluster(toMatchColor(average, space));
+    }
+}
+
+void Trufflifier::finishMatch(ParticleSystem& ps, UniqueScratch& scratch) const {
+    if (uniqueMatch) matchUnique(ps, targetPixels, targetScale, scratch);
+}
+
+void Trufflifier::sortParticles(const ParticleSystem& ps, OrderScratch& scratch) const {
+    scratch.order.clear();
+    if (particleOrder == ParticleOrder::Input || ps.size() < 2) return;
+
+    // window coords -> 16 bit grid, a bit of margin since jitter can push ends just outside
+    size_t n = ps.size();
+    float along = particleOrder == ParticleOrder::End ? 1.0f : 0.5f;
+    float w = (float)std::max(1u, preparedW), h = (float)std::max(1u, preparedH);
+    float scaleX = 60000.0f / w, scaleY = 60000.0f / h;
+    scratch.keys.resize(n);
+    scratch.order.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        float x = (ps.xs[i] + ps.dxs[i] * along) * scaleX + 2768.0f;
+        float y = (ps.ys[i] + ps.dys[i] * along) * scaleY + 2768.0f;
+        std::uint32_t qx = (std::uint32_t)std::min(std::max(x, 0.0f), 65535.0f);
+        std::uint32_t qy = (std::uint32_t)std::min(std::max(y, 0.0f), 65535.0f);
+        scratch.keys[i] = mortonKey(qx, qy);
+        scratch.order[i] = (std::uint32_t)i;
+    }
+    radixSort(scratch.keys, scratch.order, scratch.tmpKeys, scratch.tmpOrder, threadCount);
+}
+
+// gathers one column into tmp in the new order, then swaps so the old buffer becomes the next tmp
+template<typename T>
+static void gatherColumn(std::vector<T>& column, std::vector<T>& tmp, const std::vector<std::uint32_t>& order) {
+    tmp.resize(order.size());
+    for (size_t i = 0; i < order.size(); ++i) tmp[i] = column[order[i]];
+    column.swap(tmp);
+}
+
+void Trufflifier::applyOrder(ParticleSystem& ps, OrderScratch& scratch) const {
+    if (scratch.order.size() != ps.size()) return;
+    gatherColumn(ps.xs, scratch.floats, scratch.order);
+    gatherColumn(ps.ys, scratch.floats, scratch.order);
+    gatherColumn(ps.dxs, scratch.floats, scratch.order);
+    gatherColumn(ps.dys, scratch.floats, scratch.order);
+    gatherColumn(ps.sizes, scratch.floats, scratch.order);
+    gatherColumn(ps.colors, scratch.colors, scratch.order);
+    ps.delays.clear(); ps.bends.clear();
+}
+
+std::uint64_t Trufflifier::layoutKey(unsigned int windowW, unsigned int windowH) const {
+    std::uint64_t fields[] = {
+        inputHash, target ? target->hash : 0, seed, (std::uint64_t)maxParticles, gridFactor,
+        uniqueMatch, coarseMatch, (std::uint64_t)colorSpace, (std::uint64_t)particleOrder, windowW, windowH
+    };
+    return hashBytes(fields, sizeof(fields));
+}
+
+bool Trufflifier::restoreLayout(unsigned int windowW, unsigned int windowH) {
+    if (!resultCache || inputHash == 0) return false;
+    std::shared_ptr<const ParticleLayout> hit = resultCache->find(layoutKey(windowW, windowH));
+    if (!hit) return false;
+
+    // placeInput only needs the grid size, the pixels might not even be decoded
+    Stopwatch matchWatch;
+    input.width = hit->width;
+    input.height = hit->height;
+    input.step = hit->step;
+    placeInput(windowW, windowH);
+    particles = hit->particles;
+    initTimes.matchMs = matchWatch.ms();
+    return true;
+}
+
+void Trufflifier::storeLayout() {
+    if (!resultCache || inputHash == 0) return;
+    std::shared_ptr<ParticleLayout> layout(new ParticleLayout{particles, input.width, input.height, input.step, seed});
+    resultCache->insert(layoutKey(preparedW, preparedH), inputHash, layout);
+}
+
+bool ResultCache::hasInput(std::uint64_t inputHash) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return inputs.count(inputHash) > 0;
+}
+
+std::shared_ptr<const ParticleLayout> ResultCache::find(std::uint64_t key) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = byKey.find(key);
+    if (it == byKey.end()) {
+        ++misses;
+        return nullptr;
+    }
+    ++hits;
+    entries.splice(entries.begin(), entries, it->second);
+    return it->second->layout;
+}
+
+void ResultCache::insert(std::uint64_t key, std::uint64_t inputHash, std::shared_ptr<const ParticleLayout> layout) {
+    size_t size = layout->particles.size() * (5 * sizeof(float) + sizeof(sf::Color));
+    if (size > maxBytes) return;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (byKey.count(key)) return; // two workers raced on the same one, both are identical anyway
+
+    entries.push_front({key, inputHash, std::move(layout), size});
+    byKey[key] = entries.begin();
+    ++inputs[inputHash];
+    bytes += size;
+
+    while (bytes > maxBytes) {
+        const Entry& old = entries.back();
+        bytes -= old.bytes;
+        if (--inputs[old.inputHash] == 0) inputs.erase(old.inputHash);
+        byKey.erase(old.key);
+        entries.pop_back();
+    }
+}
+
+size_t ResultCache::getHits() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return hits;
+}
+
+size_t ResultCache::getMisses() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return misses;
+}
+
+void Trufflifier::startInit(unsigned int windowW, unsigned int windowH) {
+    cancelInit();
+    particles.clear();
+    vertexArray.clear();
+    prepareTarget(windowW, windowH);
+    if (restoreLayout(windowW, windowH)) {
+        initVertices();
+        return;
+    }
+    ensureInput();
+    placeInput(windowW, windowH);
+
+    size_t total = countParticles();
+    size_t bands = bandStart.size() - 1;
+
+    InitJob* job = new InitJob();
+    initJob.reset(job);
+    job->result = std::move(spareParticles);
+    job->result.resize(total);
+    job->bandDone.reset(new std::atomic<bool>[bands]);
+    for (size_t i = 0; i < bands; ++i) job->bandDone[i] = false;
+
+    // only reads the input + target side, nothing the render loop touches until poll/cancel
+    job->worker = std::thread([this, job]() {
+        Stopwatch matchWatch;
+        matchBands(job->result, job->bandDone.get(), &job->cancel);
+        if (job->cancel) return;
+        finishMatch(job->result, uniqueScratch);
+        sortParticles(job->result, orderScratch);
+        job->matchMs = matchWatch.ms();
+        job->done = true;
+    });
+}
+
+bool Trufflifier::pollInit() {
+    if (!initJob) return false;
+    InitJob& job = *initJob;
+
+    if (job.done) {
+        job.worker.join();
+        spareParticles = std::move(particles); // keeps its capacity for the next startInit
+        particles = std::move(job.result);
+        applyOrder(particles, orderScratch);
+        initTimes.matchMs = job.matchMs;
+        initJob.reset();
+        storeLayout();
+        initVertices();
+        return false;
+    }
+
+    // show whatever bands are finished from the top down, the rest fill in over the next frames
+    size_t before = particles.size();
+    while (job.revealed + 1 < bandStart.size() && job.bandDone[job.revealed]) ++job.revealed;
+
+    // unique mode rewrites every trip in finishMatch while this could still be copying,
+    // they all stay put until then anyway so the revealed ones just keep a zero trip
+    if (bandStart[job.revealed] > before) particles.copyRange(job.result, before, bandStart[job.revealed], !uniqueMatch);
+
+    // plain vertex array until the real buffers get set up at the end, colours for the new ones only
+    vertexArray.resize(particles.size() * 4);
+    for (size_t i = before; i < particles.size(); ++i) {
+        for (int k = 0; k < 4; ++k) vertexArray[i * 4 + k].color = particles.colors[i];
+    }
+    return true;
+}
+
+void Trufflifier::cancelInit() {
+    if (!initJob) return;
+    initJob->cancel = true;
+    initJob->worker.join();
+    spareParticles = std::move(initJob->result);
+    initJob.reset();
+}
+
+void Trufflifier::resize(unsigned int windowW, unsigned int windowH) {
+    // half matched, cheaper to just start over at the new size
+    if (initJob) {
+        startInit(windowW, windowH);
+        return;
+    }
+    if (particles.empty() || (windowW == preparedW && windowH == preparedH)) return;
+
+    sf::Vector2f oldInputOffset = inputOffset, oldTargetOffset = targetOffset;
+    float oldDisplayScale = displayScale, oldTargetScale = targetScale, oldBaseSize = baseParticleSize;
+
+    prepareTarget(windowW, windowH);
+    placeInput(windowW, windowH);
+
+    // start spots live in input space and end spots (jitter included) in target space,
+    // so each side is just scaled about its own offset, the matching stays as it was
+    float inputRatio = displayScale / oldDisplayScale;
+    float targetRatio = targetScale / oldTargetScale;
+    float sizeRatio = baseParticleSize / oldBaseSize;
+
+    for (size_t i = 0; i < particles.size(); ++i) {
+        float endX = particles.xs[i] + particles.dxs[i];
+        float endY = particles.ys[i] + particles.dys[i];
+
+        particles.xs[i] = inputOffset.x + (particles.xs[i] - oldInputOffset.x) * inputRatio;
+        particles.ys[i] = inputOffset.y + (particles.ys[i] - oldInputOffset.y) * inputRatio;
+        particles.setEnd(i, sf::Vector2f(targetOffset.x + (endX - oldTargetOffset.x) * targetRatio,
+                                         targetOffset.y + (endY - oldTargetOffset.y) * targetRatio));
+        particles.sizes[i] *= sizeRatio;
+    }
+
+    initVertices();
+}
+
+void Trufflifier::initVertices() {
+    size_t vertexCount = particles.size() * 4;
+    corners.clear();
+    useQuadStream = false;
+
+    animation.setSeed(seed);
+    animation.setSweep(inputOffset.y, input.height * displayScale);
+    animation.plan(particles);
+
+    if (renderMode == RenderMode::Points && !pointRenderer.init()) {
+        std::cerr << "Point sprites not available, falling back to shader rendering." << std::endl;
+        renderMode = RenderMode::Shader;
+    }
+
+    if (renderMode == RenderMode::Shader && !shaderRenderer.init()) {
+        std::cerr << "Shaders not available, falling back to cpu rendering." << std::endl;
+        renderMode = RenderMode::Cpu;
+    }
+
+    // uploaded once, the cpu only sets t after this
+    if (renderMode != RenderMode::Cpu) {
+        GpuRenderer& gpu = renderMode == RenderMode::Points ? pointRenderer : shaderRenderer;
+        animation.applyUniforms(gpu.getShader());
+        gpu.upload(particles, animation);
+        vertexArray.clear(); // no sfml quads needed at all
+        return;
+    }
+
+    // cpu mode streams positions into its own buffer, colours go up once in upload()
+    if (vertexCount > 0 && quadStream.init()) {
+        useQuadStream = true;
+        quadStream.upload(particles);
+        vertexArray.clear();
+        return;
+    }
+
+    // old drivers without buffer objects draw the sfml array
+    // keep original color, no mixing allowed
+    vertexArray.resize(vertexCount);
+    for (size_t i = 0; i < particles.size(); ++i) {
+        const sf::Color& color = particles.colors[i];
+        vertexArray[i * 4].color = color;
+        vertexArray[i * 4 + 1].color = color;
+        vertexArray[i * 4 + 2].color = color;
+        vertexArray[i * 4 + 3].color = color;
+    }
+}
+
+void Trufflifier::update(float t) {
+    uploadedVertices = 0;
+
+    // still matching, the revealed part just goes through the cpu path
+    if (initJob) {
+        if (vertexArray.getVertexCount() == 0) return;
+        corners.resize(vertexArray.getVertexCount());
+        quadKernel(particles, animation.ease(t), corners.data());
+        copyCorners();
+        uploadedVertices = vertexArray.getVertexCount();
+        return;
+    }
+
+    if (renderMode == RenderMode::Shader) {
+        shaderRenderer.setTime(t);
+        return;
+    }
+    if (renderMode == RenderMode::Points) {
+        pointRenderer.setTime(t);
+        return;
+    }
+
+    size_t vertexCount = particles.size() * 4;
+    if (vertexCount == 0) return;
+    uploadedVertices = vertexCount;
+
+    if (useQuadStream) {
+        sf::Vector2f* out = quadStream.map();
+        if (out) {
+            buildCorners(t, out);
+            quadStream.unmap();
+        } else {
+            corners.resize(vertexCount);
+            buildCorners(t, corners.data());
+            quadStream.write(corners.data());
+        }
+        return;
+    }
+
+    // no buffer objects, sfml sends the whole array every draw anyway
+    corners.resize(vertexCount);
+    buildCorners(t, corners.data());
+    copyCorners();
+}
+
+void Trufflifier::buildCorners(float t, sf::Vector2f* out) const {
+    // staggered/curved particles each need their own ease, otherwise one for everyone
+    if (!particles.delays.empty()) {
+        buildQuadsAnimated(particles, animation, t, out);
+    } else {
+        quadKernel(particles, animation.ease(t), out);
+    }
+}
+
+void Trufflifier::copyCorners() {
+    for (size_t i = 0; i < corners.size(); ++i) vertexArray[i].position = corners[i];
+}
+
+void Trufflifier::draw(sf::RenderTarget& window) {
+    if (initJob) {
+        window.draw(vertexArray);
+        return;
+    }
+
+    if (renderMode == RenderMode::Points) {
+        pointRenderer.draw(window);
+        return;
+    }
+
+    if (renderMode == RenderMode::Shader) {
+        shaderRenderer.draw(window);
+        return;
+    }
+
+    if (useQuadStream) {
+        quadStream.draw(window);
+        return;
+    }
+
+    window.draw(vertexArray);
+}
+
+void applyConfig(Trufflifier& app, const Config& config) {
+    app.setUniqueMatch(config.uniqueMatch);
+    app.setCoarseMatch(config.coarseMatch);
+    app.setColorSpace(config.colorSpace);
+    app.setAnimation(config.animation);
+    app.setParticleOrder(config.order);
+    app.setThreadCount(config.threads);
+    app.setRenderMode(config.renderMode);
+    app.setTargetCache(config.targetCache);
+    app.setSeed(config.seed);
+    app.setMaxParticles(config.maxParticles);
+}
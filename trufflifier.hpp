@@ -0,0 +1,1140 @@
+#pragma once
+
+// the trufflifier itself, main.cpp is just the cli + window/headless/export loops around it
+
+#include <SFML/Graphics.hpp>
+#include <SFML/OpenGL.hpp>
+#include <vector>
+#include <string>
+#include <random>
+#include <algorithm>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <list>
+#include <unordered_map>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define TRUFFLIFY_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define TRUFFLIFY_AVX2 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define TRUFFLIFY_NEON 1
+#include <arm_neon.h>
+#endif
+
+// who moves the particles every frame
+enum class RenderMode {
+    Cpu, // lerp on the cpu, stream positions up
+    Shader, // everything uploaded once, the vertex shader does the lerp, raw gl
+    Points // like shader but one point sprite per particle instead of a quad
+};
+
+// what colour distance means while matching
+enum class ColorSpace {
+    Rgb, // squared rgb distance, cheap but blues and greens get matched weirdly
+    OkLab // perceptual, equal distances look about equally different
+};
+
+// what order the particles sit in memory (and get drawn in) once they are matched
+enum class ParticleOrder {
+    Input, // input scanlines, how they come out of matching
+    End, // along a morton curve over the end spots, the settled picture is the part that lingers
+    Middle // morton over the trip midpoints, a bit of both ends
+};
+
+// how t turns into progress along the path
+enum class Easing {
+    OutCubic, // the original, fast start then settles
+    Linear,
+    InOutCubic,
+    OutBack, // overshoots a little then snaps back
+    Bezier // css style cubic-bezier(x1, y1, x2, y2), sampled into a table
+};
+
+// who gets to leave first
+enum class Stagger {
+    None, // everyone at once
+    Random, // each particle waits a random bit
+    Sweep // top rows of the input leave first, bottom rows last
+};
+
+struct AnimationStyle {
+    Easing easing = Easing::OutCubic;
+    float bezier[4] = {0.25f, 0.1f, 0.25f, 1.0f}; // x1 y1 x2 y2, only for Easing::Bezier
+    Stagger stagger = Stagger::None;
+    float staggerAmount = 0.3f; // share of the animation the last particle sits waiting
+    float arc = 0.0f; // sideways bulge as a share of the trip length, 0 = straight lines
+};
+
+struct Config {
+    std::vector<std::string> inputPaths; // the window only shows the first one
+    std::vector<std::string> targetPaths; // -t, just truffle.png (the secret sauce) if none are given
+    bool uniqueMatch = false; // one particle per target slot, no stacking
+    bool coarseMatch = false; // --coarse, palette lookups instead of the exact nearest colour
+    ColorSpace colorSpace = ColorSpace::Rgb;
+    AnimationStyle animation;
+    ParticleOrder order = ParticleOrder::Input;
+    unsigned int threads = 0; // 0 = all cores
+    RenderMode renderMode = RenderMode::Cpu;
+    bool targetCache = true; // <target>.idx next to the target
+    long long seed = -1; // --seed, -1 = a new one for every input
+    size_t resultCacheMb = 0; // --result-cache, finished layouts kept in memory, 0 = off
+    float maxParticles = 15000.0f;
+    unsigned int framerateLimit = 60; // 0 = as fast as it goes
+    float adaptiveMs = 0.0f; // frame time to hold by dropping particles, 0 = off
+    std::string profilePath; // per frame csv, also turns the overlay on
+    bool idleWait = true; // stop redrawing while nothing moves, --no-idle redraws every frame like before
+    unsigned int windowWidth = 800, windowHeight = 800; // --window, just the size it opens at
+    unsigned int virtualWidth = 0, virtualHeight = 0; // --virtual, fixed layout size scaled to the window, 0 = window pixels
+    unsigned int supersample = 1; // --supersample, offscreen canvas this many times the window size on each side
+
+    // headless batch stuff
+    bool headless = false;
+    std::vector<float> frames; // which t values to save, empty means just the end result
+    std::string outDir = ".";
+
+    // --serve, same as headless but jobs come in on stdin and it stays up until stdin closes
+    bool serve = false;
+    unsigned int workers = 2; // matching threads, each with its own trufflifier
+
+    // export stuff
+    std::string exportPath; // .mp4/.gif/etc goes through ffmpeg, anything else is a png sequence
+    unsigned int fps = 60;
+};
+
+const sf::Color backgroundColor(20, 20, 30);
+const unsigned int canvasSize = 800;
+const float animationDuration = 3.0f; // 3 seconds seems about right
+
+// target spot, colour + where it sits on screen
+struct TargetPixel {
+    sf::Color color;
+    sf::Vector2f pos;
+};
+
+// opaque target pixel in image coords, doesnt care about the window so it can be cached
+struct TargetTexel {
+    sf::Color color;
+    std::uint32_t x, y;
+};
+
+// a colour the way the matcher sees it, converted once up front so the distance loops never convert
+// rgb is just r, g, b. oklab is scaled by 400 (and a/b shifted by +0.4) so it lands on small
+// positive ints too (0..511), that way the colour index + hilbert sort dont care which one it is
+struct MatchColor {
+    int c[3];
+};
+
+// bits per channel a MatchColor needs in this space, for hilbertKey
+int matchColorBits(ColorSpace space);
+
+// srgb gets linearised through a 256 entry table, the only real maths left is 3 cbrts for oklab
+MatchColor toMatchColor(const sf::Color& color, ColorSpace space);
+
+inline long long matchDiff(const MatchColor& a, const MatchColor& b) {
+    long long d0 = a.c[0] - b.c[0];
+    long long d1 = a.c[1] - b.c[1];
+    long long d2 = a.c[2] - b.c[2];
+    return d0*d0 + d1*d1 + d2*d2;
+}
+
+// the input, cut down to just the pixels that become particles
+// the full decode only lives as long as loadInput so a 100mp photo doesnt hang around in ram
+struct SampledImage {
+    unsigned int width = 0, height = 0; // original size, layout still works in these units
+    unsigned int step = 1; // every step-th pixel in both directions
+    unsigned int cols = 0, rows = 0;
+    std::vector<sf::Color> pixels; // cols * rows, row major
+
+    const sf::Color& at(unsigned int col, unsigned int row) const {
+        return pixels[(size_t)row * cols + col];
+    }
+};
+
+// if the input is huge, we need to chill and downsample
+unsigned int sampleStep(unsigned int w, unsigned int h, float maxParticles);
+
+// fnv-1a, plenty for telling files apart
+std::uint64_t hashBytes(const void* data, size_t size, std::uint64_t hash = 14695981039346656037ULL);
+
+// counter based random numbers, every draw is a pure function of (seed, particle id, which draw)
+// so the layout comes out the same whatever thread ran what in whatever order. its splitmix64's
+// finaliser over the counter, no state and a few multiplies so it vectorises fine too
+enum RandomDraw : std::uint32_t {
+    DrawSize,
+    DrawMember, // which of the equally close target pixels
+    DrawJitterX,
+    DrawJitterY,
+    DrawCount
+};
+
+inline std::uint64_t randomBits(std::uint64_t seed, std::uint64_t id, std::uint32_t draw) {
+    std::uint64_t z = seed + (id * DrawCount + draw + 1) * 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// lo..hi, 24 bits is all a float holds anyway
+inline float randomFloat(std::uint64_t seed, std::uint64_t id, std::uint32_t draw, float lo, float hi) {
+    return lo + (hi - lo) * ((float)(randomBits(seed, id, draw) >> 40) * (1.0f / 16777216.0f));
+}
+
+// 0..n-1
+inline unsigned int randomIndex(std::uint64_t seed, std::uint64_t id, std::uint32_t draw, unsigned int n) {
+    return (unsigned int)(((randomBits(seed, id, draw) >> 32) * n) >> 32);
+}
+
+// dumb binary writer/reader for flat arrays, count first then the raw bytes
+template<typename T>
+void writeArray(std::vector<char>& out, const std::vector<T>& v) {
+    std::uint64_t count = v.size();
+    out.insert(out.end(), (const char*)&count, (const char*)&count + sizeof(count));
+    out.insert(out.end(), (const char*)v.data(), (const char*)v.data() + v.size() * sizeof(T));
+}
+
+template<typename T>
+bool readArray(const char*& p, const char* end, std::vector<T>& v) {
+    std::uint64_t count;
+    if ((size_t)(end - p) < sizeof(count)) return false;
+    std::memcpy(&count, p, sizeof(count));
+    p += sizeof(count);
+    if ((size_t)(end - p) / sizeof(T) < count) return false;
+    v.resize((size_t)count);
+    std::memcpy(v.data(), p, (size_t)count * sizeof(T));
+    p += count * sizeof(T);
+    return true;
+}
+
+// read only memory map of a whole file
+class MappedFile {
+private:
+    const char* ptr = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        close();
+    }
+
+    bool open(const std::string& path);
+
+    void close();
+
+    const char* data() const {
+        return ptr;
+    }
+
+    size_t size() const {
+        return length;
+    }
+};
+
+// particles as separate arrays so update() just streams through them
+// xs/ys is where they start, dxs/dys is the trip to the target
+struct ParticleSystem {
+    std::vector<float> xs, ys;
+    std::vector<float> dxs, dys;
+    std::vector<float> sizes;
+    std::vector<sf::Color> colors;
+
+    // per particle start delay + path bend, empty unless the animation staggers or curves
+    // filled in by Trufflifier::initVertices once everything is matched, push/append leave them alone
+    std::vector<float> delays, bends;
+
+    size_t size() const {
+        return xs.size();
+    }
+
+    bool empty() const {
+        return xs.empty();
+    }
+
+    void clear() {
+        xs.clear(); ys.clear();
+        dxs.clear(); dys.clear();
+        sizes.clear();
+        colors.clear();
+        delays.clear(); bends.clear();
+    }
+
+    void reserve(size_t n) {
+        xs.reserve(n); ys.reserve(n);
+        dxs.reserve(n); dys.reserve(n);
+        sizes.reserve(n);
+        colors.reserve(n);
+    }
+
+    // exact size up front, keeps the capacity so a re-init of the same size never allocates
+    // delays/bends belong to the old particles so those go
+    void resize(size_t n) {
+        xs.resize(n); ys.resize(n);
+        dxs.resize(n); dys.resize(n);
+        sizes.resize(n);
+        colors.resize(n);
+        delays.clear(); bends.clear();
+    }
+
+    void set(size_t i, sf::Vector2f start, sf::Vector2f end, float size, const sf::Color& color) {
+        xs[i] = start.x;
+        ys[i] = start.y;
+        dxs[i] = end.x - start.x;
+        dys[i] = end.y - start.y;
+        sizes[i] = size;
+        colors[i] = color;
+    }
+
+    void push(sf::Vector2f start, sf::Vector2f end, float size, const sf::Color& color) {
+        xs.push_back(start.x);
+        ys.push_back(start.y);
+        dxs.push_back(end.x - start.x);
+        dys.push_back(end.y - start.y);
+        sizes.push_back(size);
+        colors.push_back(color);
+    }
+
+    void append(const ParticleSystem& o) {
+        xs.insert(xs.end(), o.xs.begin(), o.xs.end());
+        ys.insert(ys.end(), o.ys.begin(), o.ys.end());
+        dxs.insert(dxs.end(), o.dxs.begin(), o.dxs.end());
+        dys.insert(dys.end(), o.dys.begin(), o.dys.end());
+        sizes.insert(sizes.end(), o.sizes.begin(), o.sizes.end());
+        colors.insert(colors.end(), o.colors.begin(), o.colors.end());
+    }
+
+    // grows to end and copies o's [begin, end) in, trips stay 0 when copyTrips is off
+    void copyRange(const ParticleSystem& o, size_t begin, size_t end, bool copyTrips) {
+        resize(end);
+        std::copy(o.xs.begin() + begin, o.xs.begin() + end, xs.begin() + begin);
+        std::copy(o.ys.begin() + begin, o.ys.begin() + end, ys.begin() + begin);
+        if (copyTrips) {
+            std::copy(o.dxs.begin() + begin, o.dxs.begin() + end, dxs.begin() + begin);
+            std::copy(o.dys.begin() + begin, o.dys.begin() + end, dys.begin() + begin);
+        }
+        std::copy(o.sizes.begin() + begin, o.sizes.begin() + end, sizes.begin() + begin);
+        std::copy(o.colors.begin() + begin, o.colors.begin() + end, colors.begin() + begin);
+    }
+
+    // point particle i at a new end spot
+    void setEnd(size_t i, sf::Vector2f end) {
+        dxs[i] = end.x - xs[i];
+        dys[i] = end.y - ys[i];
+    }
+};
+
+// exact nearest colour lookup over the target pixels
+// lots of target pixels share a colour so those get folded into one entry,
+// the k-d tree is built over the unique colours only
+class ColorIndex {
+private:
+    struct Node {
+        int c[3];
+        int axis;
+        int group; // which bucket of target pixels has this colour
+    };
+
+    std::vector<Node> nodes; // implicit tree, node at mid of every range
+    std::vector<int> groupStart; // group g owns members[groupStart[g] .. groupStart[g+1])
+    std::vector<int> members; // indices into targetPixels
+
+    void build(int lo, int hi);
+
+    void search(int lo, int hi, const int q[3], int& best, long long& bestDist) const;
+
+    ColorSpace space = ColorSpace::Rgb; // what the node colours are in
+
+public:
+    void build(const std::vector<TargetTexel>& targetPixels, ColorSpace colorSpace);
+
+    bool empty() const {
+        return nodes.empty();
+    }
+
+    ColorSpace colorSpace() const {
+        return space;
+    }
+
+    // raw tree + groups, for the target cache file
+    void save(std::vector<char>& out) const;
+
+    // false if anything in it points outside the arrays, pixelCount is how many texels members index
+    bool load(const char*& p, const char* end, ColorSpace colorSpace, size_t pixelCount);
+
+    // returns the group with the closest colour, -1 if there is nothing indexed
+    int nearest(const MatchColor& c) const;
+
+    int nearest(const sf::Color& c) const {
+        return nearest(toMatchColor(c, space));
+    }
+
+    int groupSize(int group) const {
+        return groupStart[group + 1] - groupStart[group];
+    }
+
+    // i-th target pixel index inside a group
+    int member(int group, int i) const {
+        return members[groupStart[group] + i];
+    }
+
+    // the distinct colours in tree order, for ColorPalette
+    size_t colorCount() const {
+        return nodes.size();
+    }
+
+    const int* colorAt(size_t i) const {
+        return nodes[i].c;
+    }
+
+    int colorGroup(size_t i) const {
+        return nodes[i].group;
+    }
+};
+
+// rough two level lookup for huge particle counts (--coarse)
+// the colours of a ColorIndex get median cut into ~sqrt(colours) clusters, a query scans the
+// cluster centres and then only the colours inside the closest one. not always the exact nearest
+// (the real one can sit just over a cluster edge) but the centre scan can be shared by a whole
+// block of similar input cells, see matchBands
+class ColorPalette {
+private:
+    struct Entry {
+        int c[3];
+        int group;
+    };
+
+    std::vector<Entry> entries; // sorted by cluster
+    std::vector<int> clusterStart; // cluster k owns entries[clusterStart[k] .. clusterStart[k + 1])
+    std::vector<MatchColor> centres; // mean colour of every cluster
+
+public:
+    void build(const ColorIndex& index);
+
+    bool empty() const {
+        return centres.empty();
+    }
+
+    size_t clusterCount() const {
+        return centres.size();
+    }
+
+    int nearestCluster(const MatchColor& c) const;
+
+    // closest colour inside one cluster, returns its group same as ColorIndex::nearest
+    int nearestInCluster(int cluster, const MatchColor& c) const;
+};
+
+// runs fn(0..count-1) across a few threads, items are handed out one at a time
+// threads = 0 means use every core
+void parallelFor(unsigned int count, unsigned int threads, const std::function<void(unsigned int)>& fn);
+
+// stable lsd radix sort of values by their keys, 8 bits a pass, each pass split into one chunk per thread
+// (histograms per chunk, then every chunk scatters into its own slice). passes where every key has the
+// same digit get skipped. the tmp vectors are just scratch, they can come in empty
+void radixSort(std::vector<std::uint32_t>& keys, std::vector<std::uint32_t>& values,
+               std::vector<std::uint32_t>& tmpKeys, std::vector<std::uint32_t>& tmpValues, unsigned int threads);
+
+// 2d morton index, x + y are 0..65535
+std::uint32_t mortonKey(std::uint32_t x, std::uint32_t y);
+
+// box filter down to the particle grid, every cell gets the average of its step x step block
+// instead of whatever single pixel sat in the corner. rgb is weighted by alpha so transparent
+// edges dont drag colours towards black. one cell row per task, reads the raw rgba rows directly
+void downsampleImage(const sf::Image& image, unsigned int step, unsigned int threads, SampledImage& out);
+
+// every pixel with alpha > 0 as a texel, row by row off the raw rgba. sse2 checks 16 alphas at once
+// so fully clear or fully solid runs go by in one compare, counted first so out is sized exactly
+void opaqueTexels(const sf::Image& image, std::vector<TargetTexel>& out);
+
+// same box filter again on an already sampled grid, factor x factor cells become one
+// used when the particle budget drops below what the grid was sampled for
+void reduceGrid(const SampledImage& in, unsigned int factor, SampledImage& out);
+
+// high res timer for the profiler, steady_clock is nanoseconds on everything we build for
+class Stopwatch {
+private:
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+public:
+    void restart() {
+        start = std::chrono::steady_clock::now();
+    }
+
+    double ms() const {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+};
+
+// writes the time spent in a scope into out, covers every early return
+class ScopedTimer {
+private:
+    Stopwatch watch;
+    double& out;
+
+public:
+    explicit ScopedTimer(double& out) : out(out) {}
+    ~ScopedTimer() {
+        out = watch.ms();
+    }
+};
+
+// how long the last load / init took, phase by phase
+struct InitTimes {
+    double loadInputMs = 0.0; // decode + downsample
+    double loadTargetMs = 0.0; // decode + texel scan + index build, or the cache map
+    double targetScanMs = 0.0; // texels -> screen positions
+    double matchMs = 0.0; // sampling + matching loop
+};
+
+// 3d hilbert curve index of an rgb colour (skilling's transpose trick)
+// colours close on the curve are close in rgb, so sorting by this works as a colour ordering
+// bits is how many bits per channel to walk, 8 for rgb, matchColorBits() for a MatchColor
+unsigned int hilbertKey(const MatchColor& c, int bits);
+
+unsigned int hilbertKey(const sf::Color& c);
+
+// quad kernels
+// lerp every particle to t and write its 4 corner positions, positions only so they can go
+// straight into the mapped stream buffer (see QuadStreamRenderer). out needs 4 per particle
+typedef void (*QuadKernel)(const ParticleSystem& ps, float t, sf::Vector2f* out);
+
+void buildQuadsScalar(const ParticleSystem& ps, float t, sf::Vector2f* out, size_t begin);
+void buildQuadsScalar(const ParticleSystem& ps, float t, sf::Vector2f* out);
+#ifdef TRUFFLIFY_AVX2
+void buildQuadsAvx2(const ParticleSystem& ps, float t, sf::Vector2f* out);
+#endif
+#ifdef TRUFFLIFY_NEON
+void buildQuadsNeon(const ParticleSystem& ps, float t, sf::Vector2f* out);
+#endif
+
+// picks the fastest kernel this cpu can run, checked once
+QuadKernel pickQuadKernel();
+
+// shader mode, start corner comes in as the position, the trip (end - start) + the particle's
+// animation key (see Animation::key) as the tex coord, the same on all 4 corners so a quad never
+// gets pulled apart. easing + stagger + arc all happen per vertex (see animationShaderCommon)
+// and the cpu only sets t
+extern const char* animationShaderCommon;
+extern const char* particleVertexShader;
+extern const char* particleFragmentShader;
+
+// raw gl bits for the gpu + cpu stream renderers and export readback, sfml only gives us gl 1.1 headers
+// on windows so the buffer functions get looked up at runtime
+#ifndef APIENTRY
+#define APIENTRY
+#endif
+#ifndef GL_ARRAY_BUFFER
+#define GL_ARRAY_BUFFER 0x8892
+#endif
+#ifndef GL_STATIC_DRAW
+#define GL_STATIC_DRAW 0x88E4
+#endif
+#ifndef GL_STREAM_DRAW
+#define GL_STREAM_DRAW 0x88E0
+#endif
+#ifndef GL_WRITE_ONLY
+#define GL_WRITE_ONLY 0x88B9
+#endif
+#ifndef GL_VERTEX_PROGRAM_POINT_SIZE
+#define GL_VERTEX_PROGRAM_POINT_SIZE 0x8642
+#endif
+#ifndef GL_PIXEL_PACK_BUFFER
+#define GL_PIXEL_PACK_BUFFER 0x88EB
+#endif
+#ifndef GL_STREAM_READ
+#define GL_STREAM_READ 0x88E1
+#endif
+#ifndef GL_READ_ONLY
+#define GL_READ_ONLY 0x88B8
+#endif
+
+// gl 1.5 buffer objects, load() needs an active context
+struct GlBufferFunctions {
+    typedef void (APIENTRY *GenBuffersFn)(GLsizei, GLuint*);
+    typedef void (APIENTRY *DeleteBuffersFn)(GLsizei, const GLuint*);
+    typedef void (APIENTRY *BindBufferFn)(GLenum, GLuint);
+    typedef void (APIENTRY *BufferDataFn)(GLenum, std::ptrdiff_t, const void*, GLenum);
+    typedef void* (APIENTRY *MapBufferFn)(GLenum, GLenum);
+    typedef GLboolean (APIENTRY *UnmapBufferFn)(GLenum);
+
+    GenBuffersFn genBuffers = nullptr;
+    DeleteBuffersFn deleteBuffers = nullptr;
+    BindBufferFn bindBuffer = nullptr;
+    BufferDataFn bufferData = nullptr;
+    MapBufferFn mapBuffer = nullptr;
+    UnmapBufferFn unmapBuffer = nullptr;
+
+    bool load();
+};
+
+// start (or start corner) in the position, trip + size + animation key in a 4 wide tex coord
+// quads have their size baked into the corners, so they carry the particle's start y there instead
+// for the sweep delay
+struct GpuVertex {
+    float x, y;
+    float dx, dy;
+    union {
+        float size; // points
+        float startY; // quads
+    };
+    float key;
+    sf::Color color;
+};
+
+// point sprite version of particleVertexShader, size comes in as the third tex coord
+extern const char* pointVertexShader;
+
+class Animation;
+
+// everything uploaded once and animated in a vertex shader, --gpu as 4 corners a particle or
+// --points as a single gl point expanded on the gpu (28 bytes per particle instead of 112)
+// raw gl instead of an sf::VertexBuffer since an sf::Vertex has no room for the animation key
+class GpuRenderer {
+private:
+    GlBufferFunctions gl;
+    GLuint buffer = 0;
+    size_t vertexCount = 0;
+    sf::Shader shader;
+    bool points;
+    bool ready = false;
+
+public:
+    explicit GpuRenderer(bool points) : points(points) {}
+
+    ~GpuRenderer() {
+        if (buffer) gl.deleteBuffers(1, &buffer);
+    }
+
+    // needs an active gl context, false if the driver cant do it
+    bool init();
+
+    void upload(const ParticleSystem& ps, const Animation& anim);
+
+    void setTime(float t) {
+        shader.setUniform("t", t);
+    }
+
+    sf::Shader& getShader() {
+        return shader;
+    }
+
+    void draw(sf::RenderTarget& target);
+};
+
+// cpu mode on the gpu side: the colours go up once into a static buffer and only the corner
+// positions get streamed every frame, 8 bytes a vertex instead of a whole 20 byte sf::Vertex
+// update() maps the stream buffer and the quad kernel writes straight into it
+class QuadStreamRenderer {
+private:
+    GlBufferFunctions gl;
+    GLuint buffers[2] = {0, 0}; // positions (stream), colours (static)
+    size_t quadCount = 0;
+    bool ready = false;
+
+public:
+    ~QuadStreamRenderer() {
+        if (buffers[0]) gl.deleteBuffers(2, buffers);
+    }
+
+    // needs an active gl context, false if the driver cant do it
+    bool init();
+
+    // the colours, once per layout
+    void upload(const ParticleSystem& ps);
+
+    // orphans the position buffer and maps it, 4 corners per particle. null if the driver wont map
+    // it, write() the positions from somewhere else then
+    sf::Vector2f* map();
+    void unmap();
+    void write(const sf::Vector2f* corners);
+
+    void draw(sf::RenderTarget& target);
+};
+
+// the default easing, no pow so its cheap enough to run per particle
+float easeOutCubic(float x);
+
+// the same hash in c++ and glsl (animationShaderCommon), 0..1 from a particle's trip
+// no sin so it comes out close enough on every gpu
+
+// an AnimationStyle worked out for the current layout, shared by update() and both shaders
+// delays + bends only depend on the particle so they get baked into the ParticleSystem once,
+// the per frame cost is one ease() per particle (or once in total without stagger)
+class Animation {
+public:
+    static constexpr int tableSize = 65; // ease table for the shaders, t = 0, 1/64 .. 1
+
+private:
+    AnimationStyle style;
+    float table[tableSize];
+    float sweepOrigin = 0.0f; // screen y of the input top
+    float sweepHeight = 0.0f;
+    float sweepScale = 0.0f; // delay per pixel below the top
+    std::uint64_t seed = 0;
+
+public:
+    Animation() {
+        setStyle(AnimationStyle());
+    }
+
+    void setStyle(const AnimationStyle& s);
+
+    const AnimationStyle& getStyle() const {
+        return style;
+    }
+
+    // where the input sits on screen, sweep delays run from its top to its bottom
+    void setSweep(float top, float height);
+
+    // the layout's seed, keys come off it
+    void setSeed(std::uint64_t value) {
+        seed = value;
+    }
+
+    // particle id -> its own random 0..1, the high bits pick the random delay and the low 12
+    // (fract(key * 4096)) the arc, same maths in the shaders. keyed off the id + seed instead of the
+    // trip so a resize (which rescales every trip) doesnt reshuffle them mid animation
+    float key(size_t id) const;
+
+    // true if the particles need their own delays/bends
+    bool perParticle() const {
+        return (style.stagger != Stagger::None && style.staggerAmount > 0.0f) || style.arc != 0.0f;
+    }
+
+    // part of the animation left once the longest delay is over
+    float span() const {
+        return style.stagger == Stagger::None ? 1.0f : std::max(0.05f, 1.0f - style.staggerAmount);
+    }
+
+    float ease(float x) const;
+
+    float delay(float startY, float key) const;
+
+    float bend(float key) const;
+
+    // fills ps.delays/ps.bends, or clears them when everyone moves together in a straight line
+    void plan(ParticleSystem& ps) const;
+
+    void applyUniforms(sf::Shader& shader) const;
+};
+
+// cpu path when particles have their own delays/bends, scalar since its one ease per particle anyway
+void buildQuadsAnimated(const ParticleSystem& ps, const Animation& anim, float t, sf::Vector2f* out);
+
+// one target image, decoded (or mapped from its cache) and indexed once, read only after that
+// screen positions depend on the window so those stay in the trufflifier
+struct Target {
+    std::string path;
+    sf::Vector2u size;
+    std::vector<TargetTexel> texels;
+    std::uint64_t hash = 0;
+    ColorIndex index;
+    ColorPalette palette; // built off the index every load, cheap enough to not bother caching
+    double loadMs = 0.0; // decode + texel scan + index build, or the cache map
+
+    bool load(const std::string& targetPath, ColorSpace space, bool useCache);
+};
+
+// every target the app can switch between, all loaded up front so switching never decodes
+class TargetLibrary {
+private:
+    std::vector<std::shared_ptr<const Target>> targets;
+
+public:
+    // loads them in parallel, any that fail get skipped, false if none worked
+    bool load(const std::vector<std::string>& paths, ColorSpace space, bool useCache, unsigned int threads);
+
+    size_t size() const {
+        return targets.size();
+    }
+
+    const std::shared_ptr<const Target>& get(size_t i) const {
+        return targets[i];
+    }
+};
+
+// colours for the unique swap pass, one float array per channel with 4 floats of padding so the
+// sse loads at the end never run off. MatchColor channels are small ints so the float maths is exact
+struct PackedColors {
+    std::vector<float> c[3];
+
+    void resize(size_t n) {
+        for (auto& v : c) v.assign(n + 4, 0.0f);
+    }
+
+    void set(size_t i, const MatchColor& m) {
+        for (int k = 0; k < 3; ++k) c[k][i] = (float)m.c[k];
+    }
+
+    void swap(size_t i, size_t j) {
+        for (auto& v : c) std::swap(v[i], v[j]);
+    }
+
+    float diff(size_t i, const PackedColors& o, size_t j) const {
+        float d0 = c[0][i] - o.c[0][j];
+        float d1 = c[1][i] - o.c[1][j];
+        float d2 = c[2][i] - o.c[2][j];
+        return d0*d0 + d1*d1 + d2*d2;
+    }
+};
+
+// everything matchUnique works in, kept between inits so re-matching doesnt allocate
+struct UniqueScratch {
+    std::vector<MatchColor> colors, targetColors;
+    std::vector<int> order, targetOrder;
+    std::vector<unsigned int> keys, targetKeys;
+    std::vector<size_t> slotOf;
+    PackedColors packed, slotColors;
+    std::vector<float> cur;
+};
+
+// a finished match, everything needed to draw it without the input or the target
+struct ParticleLayout {
+    ParticleSystem particles;
+    unsigned int width = 0, height = 0, step = 1; // the input grid it came from, enough to place it again
+    std::uint64_t seed = 0; // the animation keys come off it
+};
+
+// finished layouts in memory, keyed by everything that goes into one (see Trufflifier::layoutKey)
+// least recently used goes first once its over budget. locked so several trufflifiers can share one
+class ResultCache {
+private:
+    struct Entry {
+        std::uint64_t key;
+        std::uint64_t inputHash;
+        std::shared_ptr<const ParticleLayout> layout;
+        size_t bytes;
+    };
+
+    size_t maxBytes;
+    size_t bytes = 0;
+    size_t hits = 0, misses = 0;
+    mutable std::mutex mutex;
+    std::list<Entry> entries; // newest first
+    std::unordered_map<std::uint64_t, std::list<Entry>::iterator> byKey;
+    std::unordered_map<std::uint64_t, unsigned int> inputs; // input hash -> how many entries use it
+
+public:
+    explicit ResultCache(size_t maxBytes) : maxBytes(maxBytes) {}
+
+    // true if some layout of this input is in, loadInput only bothers decoding if not
+    bool hasInput(std::uint64_t inputHash) const;
+
+    // null on a miss, a hit moves to the front
+    std::shared_ptr<const ParticleLayout> find(std::uint64_t key);
+
+    void insert(std::uint64_t key, std::uint64_t inputHash, std::shared_ptr<const ParticleLayout> layout);
+
+    size_t getHits() const;
+    size_t getMisses() const;
+};
+
+// reorder pass scratch, kept around like UniqueScratch
+struct OrderScratch {
+    std::vector<std::uint32_t> keys, order, tmpKeys, tmpOrder;
+    std::vector<float> floats;
+    std::vector<sf::Color> colors;
+};
+
+class Trufflifier {
+private:
+    ParticleSystem particles;
+    sf::VertexArray vertexArray; // cpu copy, sized once per init, only drawn when there is no gpu buffer
+    QuadStreamRenderer quadStream; // cpu mode, colours once + positions every frame
+    bool useQuadStream = false;
+    std::vector<sf::Vector2f> corners; // kernel output when it cant write into the stream buffer
+    RenderMode renderMode = RenderMode::Cpu;
+    GpuRenderer shaderRenderer{false};
+    GpuRenderer pointRenderer{true};
+    QuadKernel quadKernel = pickQuadKernel();
+    Animation animation;
+    bool uniqueMatch = false;
+    bool coarseMatch = false;
+    ColorSpace colorSpace = ColorSpace::Rgb;
+    unsigned int threadCount = 0;
+    float baseParticleSize = 1.0f;
+    float displayScale = 1.0f; // input pixels -> screen
+    sf::Vector2f inputOffset;
+
+    // finished layouts get shared through this, with it set loadInput hashes the input and
+    // leaves it undecoded (pendingInput) if the cache has seen it, the decode only happens on a miss
+    ResultCache* resultCache = nullptr;
+    std::uint64_t inputHash = 0;
+    std::vector<char> pendingInput;
+
+    SampledImage sourceGrid; // sampled for maxParticles
+    SampledImage input; // what initParticles uses, sourceGrid or a coarser copy of it
+    float maxParticles = 15000.0f; // aiming for ~15k
+    unsigned int gridFactor = 1; // input = sourceGrid reduced by this
+    std::uint64_t seed = 0; // picked per input, or fixedSeed
+    long long fixedSeed = -1;
+    InitTimes initTimes;
+    size_t uploadedVertices = 0; // by the last update()
+
+    // target side only depends on the target + window size, so it sticks around between inputs
+    // texels + colour index come from the shared target, targetPixels adds screen positions
+    std::shared_ptr<const Target> target;
+    bool useTargetCache = true;
+    std::vector<TargetPixel> targetPixels;
+    float targetScale = 1.0f;
+    sf::Vector2f targetOffset;
+    unsigned int preparedW = 0, preparedH = 0;
+    bool targetDirty = true;
+
+    // matching writes straight into its final spot, band b owns [bandStart[b], bandStart[b + 1])
+    // counted before matching so nothing gets pushed or stitched, see countParticles
+    static constexpr unsigned int rowsPerBand = 16;
+    std::vector<size_t> bandStart;
+    UniqueScratch uniqueScratch; // only ever used by one init at a time, cancelInit joins first
+    ParticleOrder particleOrder = ParticleOrder::Input;
+    OrderScratch orderScratch; // same deal
+
+    // background init, see startInit
+    struct InitJob {
+        std::thread worker;
+        std::unique_ptr<std::atomic<bool>[]> bandDone; // set by the worker once a band is filled
+        std::atomic<bool> cancel{false};
+        std::atomic<bool> done{false};
+        ParticleSystem result; // everything, unique matching included
+        double matchMs = 0.0;
+        size_t revealed = 0; // bands already copied into particles
+    };
+    std::unique_ptr<InitJob> initJob;
+    ParticleSystem spareParticles; // result and particles swap buffers, this holds the other one
+
+public:
+    Trufflifier() : vertexArray(sf::Quads) {}
+
+    ~Trufflifier() {
+        cancelInit();
+    }
+
+    void setUniqueMatch(bool enabled) {
+        uniqueMatch = enabled;
+    }
+
+    // nearest colour through the target palette, for million particle runs. ignored with unique
+    void setCoarseMatch(bool enabled) {
+        coarseMatch = enabled;
+    }
+
+    // takes effect on the next loadTarget, the colour index is built in this space
+    void setColorSpace(ColorSpace space) {
+        colorSpace = space;
+    }
+
+    void setThreadCount(unsigned int count) {
+        threadCount = count;
+    }
+
+    void setRenderMode(RenderMode mode) {
+        renderMode = mode;
+    }
+
+    // what initVertices ended up with, it drops to cpu quietly when shaders arent there
+    RenderMode getRenderMode() const {
+        return renderMode;
+    }
+
+    // cpu mode with the position stream, false means it fell back to the sfml array
+    bool isStreamingQuads() const {
+        return useQuadStream;
+    }
+
+    // takes effect on the next loadInput, negative picks a random one for every input
+    void setSeed(long long value) {
+        fixedSeed = value;
+    }
+
+    // whatever the current input got, --seed with this gives the same layout again
+    std::uint64_t getSeed() const {
+        return seed;
+    }
+
+    // takes effect on the next initParticles/startInit
+    void setParticleOrder(ParticleOrder order) {
+        particleOrder = order;
+    }
+
+    // takes effect on the next initVertices
+    void setAnimation(const AnimationStyle& style) {
+        animation.setStyle(style);
+    }
+
+    bool load(const std::string& inputPath, const std::string& targetPath) {
+        return loadInput(inputPath) && loadTarget(targetPath);
+    }
+
+    bool loadInput(const std::string& inputPath);
+
+    // same but from an image already in memory, the benchmarks feed synthetic ones in here
+    bool loadInput(const sf::Image& inputImage);
+
+    // shared between trufflifiers, has to outlive this one. null turns it off
+    void setResultCache(ResultCache* cache) {
+        resultCache = cache;
+    }
+
+    void setTargetCache(bool enabled) {
+        useTargetCache = enabled;
+    }
+
+    // upper bound on particles, takes effect on the next loadInput
+    void setMaxParticles(float count) {
+        maxParticles = std::max(1.0f, count);
+    }
+
+    // drops (or restores) the particle count under maxParticles without reloading
+    // returns true if the grid changed, initParticles has to run again after that
+    bool setParticleBudget(float budget);
+
+    size_t getParticleCount() const {
+        return particles.size();
+    }
+
+    size_t getUploadedVertexCount() const {
+        return uploadedVertices;
+    }
+
+    const InitTimes& getInitTimes() const {
+        return initTimes;
+    }
+
+    // loads a single target just for this trufflifier, the library is for switching between several
+    bool loadTarget(const std::string& targetPath);
+
+    // switch to an already loaded target, nothing gets decoded, initParticles/startInit rematches
+    void setTarget(std::shared_ptr<const Target> next);
+
+    long long colorDiff(const sf::Color& c1, const sf::Color& c2) {
+        long long dr = (long long)c1.r - c2.r;
+        long long dg = (long long)c1.g - c2.g;
+        long long db = (long long)c1.b - c2.b;
+        return dr*dr + dg*dg + db*db;
+    }
+
+    // one-to-one matching, every particle gets its own slot on the target
+    // the truffle is way smaller than the particle count so each target pixel is split
+    // into sub*sub slots until there are enough to go around
+    // both sides get sorted along the hilbert curve and paired up by rank (basically
+    // histogram matching), then a few passes of neighbour swaps clean up the rough spots
+    void matchUnique(ParticleSystem& ps, const std::vector<TargetPixel>& targetPixels, float targetScale, UniqueScratch& scratch) const;
+
+    // 1. where do we want them to go?
+    // only redone when the target or window size changes, batch runs reuse it for every input
+    // one pass over the texels, the colour index doesnt care about positions
+    void prepareTarget(unsigned int windowW, unsigned int windowH);
+
+    // where the input sits in the window, sets displayScale + inputOffset + baseParticleSize
+    void placeInput(unsigned int windowW, unsigned int windowH);
+
+    void initParticles(unsigned int windowW, unsigned int windowH);
+
+    // initParticles minus the vertex setup, so it never touches gl and works on any thread
+    void matchParticles(unsigned int windowW, unsigned int windowH);
+
+    // hands the matched particles over (this one is left empty), for matching on one
+    // trufflifier and drawing on another
+    ParticleLayout takeLayout();
+
+    // draw a layout matched somewhere else, sized for the same window it was matched for
+    void setLayout(ParticleLayout&& layout, unsigned int windowW, unsigned int windowH);
+
+    // downsamples into sourceGrid, what loadInput + ensureInput share
+    void sampleInput(const sf::Image& inputImage);
+
+    // decodes pendingInput if loadInput left one, false if that fails
+    bool ensureInput();
+
+    // input + target + every setting the layout depends on, hashed into one key
+    std::uint64_t layoutKey(unsigned int windowW, unsigned int windowH) const;
+
+    // result cache hit -> particles + input size back, false on a miss
+    bool restoreLayout(unsigned int windowW, unsigned int windowH);
+
+    // the fresh match goes into the result cache, prepared window size as the key
+    void storeLayout();
+
+    unsigned int getBandCount() const;
+
+    // opaque input cells per band -> bandStart, returns the exact particle count
+    size_t countParticles();
+
+    // 3. the per pixel matching, one task per band of rowsPerBand input rows
+    // out has to be countParticles() big already, every band fills its own range of it
+    // bandDone[b] gets set once band b is filled, a set cancel stops it picking up new bands
+    void matchBands(ParticleSystem& out, std::atomic<bool>* bandDone, const std::atomic<bool>* cancel) const;
+
+    // --coarse, the palette cluster of every 2x2 input block starting at row, one per block column
+    void blockClusters(unsigned int row, std::vector<int>& out) const;
+
+    // unique mode places them all at once after the bands, nothing to do otherwise
+    void finishMatch(ParticleSystem& ps, UniqueScratch& scratch) const;
+
+    // 4. optional reorder, sortParticles works out scratch.order (left empty for ParticleOrder::Input)
+    // and applyOrder moves every column into it. split so the background init can sort on the
+    // worker while the render loop is still reading the bands, the move happens after the join
+    void sortParticles(const ParticleSystem& ps, OrderScratch& scratch) const;
+    void applyOrder(ParticleSystem& ps, OrderScratch& scratch) const;
+
+    // initParticles on a worker thread so the window stays responsive
+    // pollInit() once a frame shows the finished bands top to bottom and swaps in the real
+    // buffers when the worker is done, returns false once there is nothing left to wait for
+    void startInit(unsigned int windowW, unsigned int windowH);
+    bool pollInit();
+    void cancelInit();
+
+    bool isInitializing() const {
+        return initJob != nullptr;
+    }
+
+    // window changed size, keeps every particle on the target spot it already has and just
+    // moves the start + end positions to the new layout, one pass over the particles
+    void resize(unsigned int windowW, unsigned int windowH);
+
+    // size the vertex storage once, colours never change so they only get written here
+    // update() just overwrites positions after this, in cpu mode straight into the stream buffer
+    void initVertices();
+
+
+    void update(float t);
+
+    // every corner at t, with the stagger/arc if the animation has them
+    void buildCorners(float t, sf::Vector2f* out) const;
+
+    // corners -> vertexArray positions, for the paths that draw the array
+    void copyCorners();
+
+    void draw(sf::RenderTarget& window);
+};
+
+// everything from the command line that the trufflifier itself cares about
+void applyConfig(Trufflifier& app, const Config& config);